@@ -10,19 +10,40 @@
 #define MODULE_API
 #endif
 
-#define MODULE_API_VERSION 1
+#define MODULE_API_VERSION 7
 
 // --------------------------------------------------------------------------------
 
+// Handle to an interned MQTT topic. Topics are formatted and looked up once when interned,
+// and publishing or subscribing through the handle does no string processing at all.
+struct message_topic_t;
+
+// Last value received to a topic.
+struct message_cached_t {
+	const char *payload;	// Null terminated copy of the payload
+	size_t length;			// Payload length without the terminator
+	uint64_t timestamp;		// Monotonic time in milliseconds when the value was received
+	uint64_t sequence;		// Increases with every value received to any topic
+};
+
 typedef void (*message_update_t)(const char *topic, const char *message, void *context);
 #define MESSAGE_HANDLER(x) static void x(const char *topic, const char *message, void *context)
 
+// Extended message handler. The topic is the handle of the topic the message was published to (which may differ
+// from the subscribed filter when using wildcards), and the payload points directly to the received data.
+// The payload is not null terminated and is only valid for the duration of the call.
+typedef void (*message_update_ex_t)(struct message_topic_t *topic, const void *payload, size_t length, void *context);
+#define MESSAGE_HANDLER_EX(x) static void x(struct message_topic_t *topic, const void *payload, size_t length, void *context)
+
 typedef void (*config_handler_t)(char *args);
 #define CONFIG_HANDLER(x) static void x(char *args)
 
 typedef bool (*web_api_handler_t)(const char *request_url, const char **content);
 #define WEB_API_HANDLER(x) static bool x(const char *request_url, const char **content)
 
+typedef void (*timer_handler_t)(void *context);
+#define TIMER_HANDLER(x) static void x(void *context)
+
 // --------------------------------------------------------------------------------
 
 struct module_import_t {
@@ -42,6 +63,37 @@ struct module_import_t {
 	void (*message_subscribe)(void *context, message_update_t callback, const char *topic_fmt, ...);
 	void (*message_unsubscribe)(void *context, message_update_t callback, const char *topic_fmt, ...);
 
+	// Messaging through interned topics. Interning the same topic twice returns the same handle,
+	// and every handle must be released once the module no longer uses it.
+	struct message_topic_t *(*message_intern_topic)(const char *topic_fmt, ...);
+	void (*message_release_topic)(struct message_topic_t *topic);
+	void (*message_publish_topic)(struct message_topic_t *topic, const char *message);
+	void (*message_publish_topic_data)(struct message_topic_t *topic, void *data, size_t data_size);
+
+	// Publish the latest state of a rapidly changing value. Values published to the same topic within
+	// the coalescing window (mqtt_coalesce_window) replace each other, and only the latest one is sent.
+	void (*message_publish_topic_coalesced)(struct message_topic_t *topic, const char *message);
+
+	void (*message_subscribe_topic)(void *context, message_update_t callback, struct message_topic_t *topic);
+	void (*message_unsubscribe_topic)(void *context, message_update_t callback, struct message_topic_t *topic);
+
+	// Get the last value received to a subscribed topic, or NULL if nothing has been received yet.
+	// The value is valid until the next message to the topic is processed.
+	const struct message_cached_t *(*message_get_cached)(struct message_topic_t *topic);
+
+	// Subscribe with an extended message handler, which is given the payload and its length without any copies.
+	void (*message_subscribe_ex)(void *context, message_update_ex_t callback, struct message_topic_t *topic);
+	void (*message_unsubscribe_ex)(void *context, message_update_ex_t callback, struct message_topic_t *topic);
+	const char *(*message_get_topic_name)(struct message_topic_t *topic);
+
+	// Publish a payload without copying it. The payload must be allocated with message_alloc_payload,
+	// and belongs to the daemon after the call whether or not the message could be sent.
+	// Use message_free_payload to release a payload which is not going to be published after all.
+	void *(*message_alloc_payload)(size_t size);
+	void (*message_free_payload)(void *payload);
+	void (*message_publish_payload)(void *payload, size_t payload_size, const char *topic_fmt, ...);
+	void (*message_publish_topic_payload)(struct message_topic_t *topic, void *payload, size_t payload_size);
+
 	// Wep API
 	void (*webapi_register_interface)(const char *iface, web_api_handler_t handler);
 	void (*webapi_unregister_interface)(const char *iface);
@@ -49,6 +101,11 @@ struct module_import_t {
 	// Module interaction
 	void *(*get_module_api)(const char *module_name);
 
+	// Scheduling. Handlers are called from the main loop once delay_ms has passed and then every interval_ms
+	// (0 for one-shot timers). Timers which are still pending must be cancelled when the module shuts down.
+	uint32_t (*timer_schedule)(uint32_t delay_ms, uint32_t interval_ms, timer_handler_t handler, void *context);
+	void (*timer_cancel)(uint32_t timer);
+
 	// Utilities
 	void *(*alloc)(size_t size);
 	void (*free)(void *ptr);
@@ -62,7 +119,7 @@ struct module_export_t {
 	uint32_t api_version;	// module.h version used to compile this module with
 	void *api;				// API this module exports to other modules (optional)
 
-	void (*process)(void);
+	void (*process)(void);	// Polled about every 10ms if set (optional, prefer scheduling timers instead)
 	void (*shutdown)(void);
 	void (*on_module_loaded)(const char *module);
 	void (*on_module_unloaded)(const char *module);
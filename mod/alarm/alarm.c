@@ -35,7 +35,7 @@ struct alarm_light_t {
 #define MAX_WAKEUP_TIME 15
 #define MIN_KEEPON_TIME 1
 #define MAX_KEEPON_TIME 60
-#define ALARM_UPDATE_INTERVAL 10 // Process the alarm lights once every 10 seconds.
+#define ALARM_UPDATE_INTERVAL 10000 // Process the alarm lights once every 10 seconds.
 
 static uint8_t alarm_wakeup_time = 10; // Minutes before the alarm to start turning the lights on
 static uint8_t alarm_keepon_time = 45; // Minutes after the alarm to keep the lights toggled on
@@ -46,7 +46,7 @@ static uint32_t alarm_count = 0; // Number of active alarms
 static struct alarm_t *alarms; // List of alarm entries
 static struct alarm_light_t *alarm_lights; // List of lights attached to the alarm system
 
-static time_t alarm_previous_update = 0;
+static uint32_t alarm_update_timer = 0; // Periodic timer for updating the alarm lights
 
 // --------------------------------------------------------------------------------
 
@@ -57,6 +57,7 @@ static void alarm_calculate_next_trigger_time(struct alarm_t *alarm);
 static void alarm_sort_all(void);
 static void alarm_set_override_light_brightness(float brightness);
 
+TIMER_HANDLER(alarm_update);
 
 CONFIG_HANDLER(alarm_add_light);
 WEB_API_HANDLER(alarm_process_api_request);
@@ -76,10 +77,17 @@ void alarm_initialize(void)
 
 	// Register a handler for web API requests.
 	api.webapi_register_interface("alarm", alarm_process_api_request);
+
+	// We don't have to update the alarm system all the time, a couple of times per minute is enough.
+	alarm_update_timer = api.timer_schedule(0, ALARM_UPDATE_INTERVAL, alarm_update, NULL);
 }
 
 void alarm_shutdown(void)
 {
+	// Stop updating the alarm lights.
+	api.timer_cancel(alarm_update_timer);
+	alarm_update_timer = 0;
+
 	// Unregister the web API handler for this module.
 	api.webapi_unregister_interface("alarm");
 
@@ -103,18 +111,11 @@ void alarm_shutdown(void)
 	alarm_count = 0;
 }
 
-void alarm_process(void)
+TIMER_HANDLER(alarm_update)
 {
 	// Get the current time.
 	time_t now = time(NULL);
 
-	// We don't have to update the alarm system once every process cycle, a couple of times per minute is enough.
-	if (now - alarm_previous_update < ALARM_UPDATE_INTERVAL) {
-		return;
-	}
-
-	alarm_previous_update = now;
-
 	// Find the highest progress for an alarm. This is used to set an override brightness for the lights.
 	// If no alarms are in progress, the progress will be left to 0 and all lights will turn off.
 	float alarm_progress = 0.0f;
@@ -392,8 +393,9 @@ WEB_API_HANDLER(alarm_process_api_request)
 			if (alarm != NULL) {
 				alarm_calculate_next_trigger_time(alarm);
 
-				// Force a re-evaluation of the current alarm progress.
-				alarm_previous_update = 0;
+				// Force a re-evaluation of the current alarm progress. Web API requests are handled on the main thread,
+				// so the update can run right away instead of from a timer which could outlive the module.
+				alarm_update(NULL);
 			}
 		}
 
@@ -8,6 +8,5 @@
 
 void alarm_initialize(void);
 void alarm_shutdown(void);
-void alarm_process(void);
 
 #endif
@@ -18,7 +18,6 @@ MODULE_API struct module_export_t *module_initialize(struct module_import_t *imp
 
 	// Initialize the export object and return it.
 	export.api_version = MODULE_API_VERSION;
-	export.process = alarm_process;
 	export.shutdown = alarm_shutdown;
 	export.on_module_loaded = on_module_loaded;
 	export.on_module_unloaded = on_module_unloaded;
@@ -14,15 +14,16 @@ static struct light_t *current_light;
 
 static uint16_t light_brightness_to_pwm(struct light_t *light, uint16_t value);
 static uint16_t light_pwm_to_brightness(struct light_t *light, uint16_t value);
+static int light_parse_value(const void *payload, size_t length);
 
 CONFIG_HANDLER(set_light_identifier);
 CONFIG_HANDLER(set_light_name);
 CONFIG_HANDLER(set_light_enabled);
 CONFIG_HANDLER(set_light_pwm_bits);
 
-MESSAGE_HANDLER(update_light_toggle);
-MESSAGE_HANDLER(update_light_max_brightness);
-MESSAGE_HANDLER(update_light_transition_time);
+MESSAGE_HANDLER_EX(update_light_toggle);
+MESSAGE_HANDLER_EX(update_light_max_brightness);
+MESSAGE_HANDLER_EX(update_light_transition_time);
 
 // --------------------------------------------------------------------------------
 
@@ -53,11 +54,30 @@ struct light_t *light_create(const char *config_file)
 		return NULL;
 	}
 
+	// Intern the topics of the light once, so updating the light won't have to format them again.
+	current_light->toggle_topic = api.message_intern_topic(LIGHT_TOGGLE_TOPIC, current_light->identifier);
+	current_light->min_brightness_topic = api.message_intern_topic(LIGHT_MIN_BRIGHTNESS_TOPIC, current_light->identifier);
+	current_light->max_brightness_topic = api.message_intern_topic(LIGHT_MAX_BRIGHTNESS_TOPIC, current_light->identifier);
+	current_light->transition_time_topic = api.message_intern_topic(LIGHT_TRANSITION_TIME_TOPIC, current_light->identifier);
+
 	// Register listeners for the messages regarding the status of the light.
 	// We should be receiving the current states as soon as messaging is initialized.
-	api.message_subscribe(current_light, update_light_toggle, LIGHT_TOGGLE_TOPIC, current_light->identifier);
-	api.message_subscribe(current_light, update_light_max_brightness, LIGHT_MAX_BRIGHTNESS_TOPIC, current_light->identifier);
-	api.message_subscribe(current_light, update_light_transition_time, LIGHT_TRANSITION_TIME_TOPIC, current_light->identifier);
+	api.message_subscribe_ex(current_light, update_light_toggle, current_light->toggle_topic);
+	api.message_subscribe_ex(current_light, update_light_max_brightness, current_light->max_brightness_topic);
+	api.message_subscribe_ex(current_light, update_light_transition_time, current_light->transition_time_topic);
+
+	// If the states are already known from earlier messages, use them right away instead of waiting for the server.
+	const struct message_cached_t *cached;
+
+	if ((cached = api.message_get_cached(current_light->toggle_topic)) != NULL) {
+		update_light_toggle(current_light->toggle_topic, cached->payload, cached->length, current_light);
+	}
+	if ((cached = api.message_get_cached(current_light->max_brightness_topic)) != NULL) {
+		update_light_max_brightness(current_light->max_brightness_topic, cached->payload, cached->length, current_light);
+	}
+	if ((cached = api.message_get_cached(current_light->transition_time_topic)) != NULL) {
+		update_light_transition_time(current_light->transition_time_topic, cached->payload, cached->length, current_light);
+	}
 
 	current_light->has_subscribed = true;
 
@@ -68,9 +88,14 @@ void light_destroy(struct light_t *light)
 {
 	// Unregister all message listeners.
 	if (light->has_subscribed) {
-		api.message_unsubscribe(light, update_light_toggle, LIGHT_TOGGLE_TOPIC, light->identifier);
-		api.message_unsubscribe(light, update_light_max_brightness, LIGHT_MAX_BRIGHTNESS_TOPIC, light->identifier);
-		api.message_unsubscribe(light, update_light_transition_time, LIGHT_TRANSITION_TIME_TOPIC, light->identifier);
+		api.message_unsubscribe_ex(light, update_light_toggle, light->toggle_topic);
+		api.message_unsubscribe_ex(light, update_light_max_brightness, light->max_brightness_topic);
+		api.message_unsubscribe_ex(light, update_light_transition_time, light->transition_time_topic);
+
+		api.message_release_topic(light->toggle_topic);
+		api.message_release_topic(light->min_brightness_topic);
+		api.message_release_topic(light->max_brightness_topic);
+		api.message_release_topic(light->transition_time_topic);
 	}
 
 	api.free(light->identifier);
@@ -86,7 +111,7 @@ void light_set_toggled(struct light_t *light, bool toggle)
 
 	// Send a message to toggle the status of the light.
 	// We'll update the light struct once the MQTT server confirms the value has been changed.
-	api.message_publish(toggle ? "1" : "0", LIGHT_TOGGLE_TOPIC, light->identifier);
+	api.message_publish_topic(light->toggle_topic, toggle ? "1" : "0");
 }
 
 void light_set_min_brightness(struct light_t *light, float min_brightness_percentage)
@@ -111,7 +136,7 @@ void light_set_min_brightness(struct light_t *light, float min_brightness_percen
 	sprintf(message, "%u", brightness);
 
 	// Send a message to change the minimum (override) brightness of the light.
-	api.message_publish(message, LIGHT_MIN_BRIGHTNESS_TOPIC, light->identifier);
+	api.message_publish_topic_coalesced(light->min_brightness_topic, message);
 }
 
 void light_set_max_brightness(struct light_t *light, uint16_t max_brightness)
@@ -124,7 +149,7 @@ void light_set_max_brightness(struct light_t *light, uint16_t max_brightness)
 	sprintf(message, "%u", light_brightness_to_pwm(light, max_brightness));
 
 	// Send a message to change the max brightness of the light.
-	api.message_publish(message, LIGHT_MAX_BRIGHTNESS_TOPIC, light->identifier);
+	api.message_publish_topic_coalesced(light->max_brightness_topic, message);
 
 	// If an override minimum brightness has been defined for the light, update it too.
 	float override_brightness = light->min_brightness;
@@ -145,7 +170,7 @@ void light_set_transition_time(struct light_t *light, uint16_t transition_time)
 	sprintf(message, "%u", transition_time);
 
 	// Send a message to change the transition time of the light.
-	api.message_publish(message, LIGHT_TRANSITION_TIME_TOPIC, light->identifier);
+	api.message_publish_topic(light->transition_time_topic, message);
 }
 
 static uint16_t light_brightness_to_pwm(struct light_t *light, uint16_t value)
@@ -174,6 +199,26 @@ static uint16_t light_pwm_to_brightness(struct light_t *light, uint16_t value)
 	return (uint16_t)(x * DEFAULT_BRIGHTNESS);
 }
 
+static int light_parse_value(const void *payload, size_t length)
+{
+	// Parse a decimal number from the payload. The payload isn't null terminated, so never read past its length.
+	const char *s = payload;
+	const char *end = s + length;
+
+	bool is_negative = (s < end && *s == '-');
+	int value = 0;
+
+	if (is_negative) {
+		++s;
+	}
+
+	for (; s < end && *s >= '0' && *s <= '9'; ++s) {
+		value = 10 * value + (*s - '0');
+	}
+
+	return (is_negative ? -value : value);
+}
+
 CONFIG_HANDLER(set_light_identifier)
 {
 	if (current_light == NULL || args == NULL || *args == 0) {
@@ -219,20 +264,20 @@ CONFIG_HANDLER(set_light_pwm_bits)
 	current_light->pwm_bits = (pwm < 0x10 ? pwm : 0xF);
 }
 
-MESSAGE_HANDLER(update_light_toggle)
+MESSAGE_HANDLER_EX(update_light_toggle)
 {
 	struct light_t *light = (struct light_t *)context;
-	light->is_toggled = (atoi(message) != 0);
+	light->is_toggled = (light_parse_value(payload, length) != 0);
 }
 
-MESSAGE_HANDLER(update_light_max_brightness)
+MESSAGE_HANDLER_EX(update_light_max_brightness)
 {
 	struct light_t *light = (struct light_t *)context;
-	light->max_brightness = light_pwm_to_brightness(light, (uint16_t)atoi(message));
+	light->max_brightness = light_pwm_to_brightness(light, (uint16_t)light_parse_value(payload, length));
 }
 
-MESSAGE_HANDLER(update_light_transition_time)
+MESSAGE_HANDLER_EX(update_light_transition_time)
 {
 	struct light_t *light = (struct light_t *)context;
-	light->transition_time = (uint16_t)atoi(message);
+	light->transition_time = (uint16_t)light_parse_value(payload, length);
 }
@@ -12,6 +12,10 @@
 struct light_t {
 	char *identifier;
 	char *name;
+	struct message_topic_t *toggle_topic;
+	struct message_topic_t *min_brightness_topic;
+	struct message_topic_t *max_brightness_topic;
+	struct message_topic_t *transition_time_topic;
 	bool has_subscribed;
 	bool is_enabled;
 	bool is_toggled;
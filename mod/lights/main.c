@@ -13,11 +13,6 @@ MODULE_API void on_module_unloaded(const char *mod);
 
 // --------------------------------------------------------------------------------
 
-static void module_process(void)
-{
-	lights_process();
-}
-
 static void module_shutdown(void)
 {
 	lights_shutdown();
@@ -34,7 +29,6 @@ MODULE_API struct module_export_t *module_initialize(struct module_import_t *imp
 	// Initialize the export object and return it.
 	export.api_version = MODULE_API_VERSION;
 	export.api = &lights_api;
-	export.process = module_process;
 	export.shutdown = module_shutdown;
 	export.on_module_loaded = on_module_loaded;
 	export.on_module_unloaded = on_module_unloaded;
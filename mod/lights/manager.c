@@ -72,13 +72,6 @@ void lights_shutdown(void)
 	api.webapi_unregister_interface("lights");
 }
 
-void lights_process(void)
-{
-	// Turns out we don't have anything to do here, at least just yet.
-	//LIST_FOREACH(struct light_t, light, lights) {
-	//}
-}
-
 void lights_set_min_brightness(const char *identifier, float percentage)
 {
 	if (identifier == NULL) {
@@ -7,7 +7,6 @@
 
 void lights_initialize(void);
 void lights_shutdown(void);
-void lights_process(void);
 
 void lights_set_min_brightness(const char *identifier, float percentage);
 
@@ -0,0 +1,269 @@
+#include "events.h"
+#include "utils.h"
+#include "logger.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+// --------------------------------------------------------------------------------
+
+enum {
+	SOURCE_FD,		// A descriptor owned by someone else, only watched by the event loop
+	SOURCE_TIMER,	// A timerfd owned by the event loop
+	SOURCE_WAKEUP,	// An eventfd owned by the event loop
+};
+
+struct event_source_t {
+	int fd;
+	int type;
+	bool is_removed;
+	event_handler_t handler;
+	void *context;
+	struct event_source_t *next;
+};
+
+#define MAX_EVENTS 32
+
+static int epoll_fd = -1;
+static struct event_source_t *sources;
+static struct event_source_t *removed_sources; // Sources removed during dispatch, freed after the batch has been handled.
+
+// --------------------------------------------------------------------------------
+
+static struct event_source_t *events_add_source(int fd, int type, uint32_t events, event_handler_t handler, void *context);
+static struct event_source_t *events_find_source(int fd);
+static void events_destroy_source(struct event_source_t *source);
+
+// --------------------------------------------------------------------------------
+
+void events_initialize(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (epoll_fd < 0) {
+		output_error("Unable to create the event loop: %s", strerror(errno));
+		exit(0);
+	}
+}
+
+void events_shutdown(void)
+{
+	LIST_FOREACH_SAFE(struct event_source_t, source, tmp, sources) {
+		tmp = source->next;
+		events_destroy_source(source);
+	}
+
+	LIST_FOREACH_SAFE(struct event_source_t, source, tmp, removed_sources) {
+		tmp = source->next;
+		utils_free(source);
+	}
+
+	sources = NULL;
+	removed_sources = NULL;
+
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+void events_process(void)
+{
+	struct epoll_event ready[MAX_EVENTS];
+
+	int count = epoll_wait(epoll_fd, ready, MAX_EVENTS, -1);
+
+	if (count < 0) {
+		if (errno != EINTR) {
+			output_error("Event loop wait failed: %s", strerror(errno));
+		}
+		return;
+	}
+
+	for (int i = 0; i < count; ++i) {
+
+		struct event_source_t *source = ready[i].data.ptr;
+
+		// The source may have been removed by a handler earlier in this batch.
+		if (source->is_removed) {
+			continue;
+		}
+
+		uint32_t events = 0;
+
+		if (ready[i].events & EPOLLIN) { events |= EVENT_READ; }
+		if (ready[i].events & EPOLLOUT) { events |= EVENT_WRITE; }
+		if (ready[i].events & (EPOLLERR | EPOLLHUP)) { events |= EVENT_ERROR; }
+
+		// Timers and wakeups have to be drained so they don't stay readable.
+		if (source->type != SOURCE_FD) {
+			uint64_t value;
+			ssize_t n = read(source->fd, &value, sizeof(value));
+			(void)n;
+		}
+
+		source->handler(source->fd, events, source->context);
+	}
+
+	// Free sources which were removed while dispatching.
+	LIST_FOREACH_SAFE(struct event_source_t, source, tmp, removed_sources) {
+		tmp = source->next;
+		utils_free(source);
+	}
+
+	removed_sources = NULL;
+}
+
+bool events_add_fd(int fd, uint32_t events, event_handler_t handler, void *context)
+{
+	if (fd < 0 || handler == NULL) {
+		return false;
+	}
+
+	return (events_add_source(fd, SOURCE_FD, events, handler, context) != NULL);
+}
+
+void events_remove_fd(int fd)
+{
+	struct event_source_t *source = events_find_source(fd);
+
+	if (source == NULL) {
+		return;
+	}
+
+	LIST_REMOVE_ENTRY(struct event_source_t, source, sources);
+	events_destroy_source(source);
+}
+
+int events_create_timer(uint32_t delay_ms, uint32_t interval_ms, event_handler_t handler, void *context)
+{
+	if (handler == NULL) {
+		return -1;
+	}
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		output_error("Unable to create a timer: %s", strerror(errno));
+		return -1;
+	}
+
+	if (events_add_source(fd, SOURCE_TIMER, EVENT_READ, handler, context) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	events_set_timer(fd, delay_ms, interval_ms);
+	return fd;
+}
+
+void events_set_timer(int timer, uint32_t delay_ms, uint32_t interval_ms)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	// A zero it_value disarms the timer, so an immediate timer is armed to expire in a nanosecond instead.
+	spec.it_value.tv_sec = delay_ms / 1000;
+	spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+
+	if (delay_ms == 0) {
+		spec.it_value.tv_nsec = 1;
+	}
+
+	spec.it_interval.tv_sec = interval_ms / 1000;
+	spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+	timerfd_settime(timer, 0, &spec, NULL);
+}
+
+void events_clear_timer(int timer)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	timerfd_settime(timer, 0, &spec, NULL);
+}
+
+int events_create_wakeup(event_handler_t handler, void *context)
+{
+	if (handler == NULL) {
+		return -1;
+	}
+
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fd < 0) {
+		output_error("Unable to create a wakeup event: %s", strerror(errno));
+		return -1;
+	}
+
+	if (events_add_source(fd, SOURCE_WAKEUP, EVENT_READ, handler, context) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void events_signal_wakeup(int wakeup)
+{
+	// Safe to call from any thread. Multiple signals before the loop wakes up are merged into one.
+	uint64_t value = 1;
+	ssize_t n = write(wakeup, &value, sizeof(value));
+	(void)n;
+}
+
+static struct event_source_t *events_add_source(int fd, int type, uint32_t events, event_handler_t handler, void *context)
+{
+	struct event_source_t *source = utils_alloc(sizeof(*source));
+	source->fd = fd;
+	source->type = type;
+	source->handler = handler;
+	source->context = context;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+
+	ev.data.ptr = source;
+
+	if (events & EVENT_READ) { ev.events |= EPOLLIN; }
+	if (events & EVENT_WRITE) { ev.events |= EPOLLOUT; }
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		output_error("Unable to watch descriptor %d: %s", fd, strerror(errno));
+		utils_free(source);
+		return NULL;
+	}
+
+	LIST_ADD_ENTRY(sources, source);
+	return source;
+}
+
+static struct event_source_t *events_find_source(int fd)
+{
+	LIST_FOREACH(struct event_source_t, source, sources) {
+		if (source->fd == fd) {
+			return source;
+		}
+	}
+
+	return NULL;
+}
+
+static void events_destroy_source(struct event_source_t *source)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+	if (source->type != SOURCE_FD) {
+		close(source->fd);
+	}
+
+	// The source may still be referenced by the batch currently being dispatched, so defer freeing it.
+	source->is_removed = true;
+	source->next = removed_sources;
+	removed_sources = source;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#ifndef __SMARTHOME_EVENTS_H
+#define __SMARTHOME_EVENTS_H
+
+#include "defines.h"
+
+// --------------------------------------------------------------------------------
+
+// Readiness flags passed to and from the event loop.
+#define EVENT_READ 0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4
+
+typedef void (*event_handler_t)(int fd, uint32_t events, void *context);
+#define EVENT_HANDLER(x) static void x(int fd, uint32_t events, void *context)
+
+// --------------------------------------------------------------------------------
+
+void events_initialize(void);
+void events_shutdown(void);
+
+// Wait until at least one registered source is ready and dispatch its handler.
+// Blocks indefinitely when there is nothing to do.
+void events_process(void);
+
+// Watch an existing file descriptor. The descriptor is not closed when removed.
+bool events_add_fd(int fd, uint32_t events, event_handler_t handler, void *context);
+void events_remove_fd(int fd);
+
+// Create a timer which fires once after delay_ms and then every interval_ms (0 for a one-shot timer).
+// Returns a descriptor which identifies the timer, or -1 on failure. Destroy with events_remove_fd.
+int events_create_timer(uint32_t delay_ms, uint32_t interval_ms, event_handler_t handler, void *context);
+void events_set_timer(int timer, uint32_t delay_ms, uint32_t interval_ms);
+void events_clear_timer(int timer);
+
+// Create a wakeup source which can be signalled from any thread to run the handler on the event loop thread.
+// Returns a descriptor which identifies the source, or -1 on failure. Destroy with events_remove_fd.
+int events_create_wakeup(event_handler_t handler, void *context);
+void events_signal_wakeup(int wakeup);
+
+#endif
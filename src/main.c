@@ -1,11 +1,15 @@
 #include "main.h"
 #include "config.h"
+#include "events.h"
+#include "scheduler.h"
 #include "modules.h"
 #include "messaging.h"
 #include "webapi.h"
 #include "utils.h"
 #include "logger.h"
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 static bool running = true;
 static char config_directory[260] = { "./config" };
@@ -13,22 +17,43 @@ static char config_directory[260] = { "./config" };
 #ifndef DAEMON
 
 static char input[512];
+static size_t input_length = 0;
 
 CONFIG_HANDLER(quit)
 {
 	running = false;
 }
 
-THREAD(input_thread)
+EVENT_HANDLER(process_console_input)
 {
-	(void)args;
+	ssize_t received = read(fd, input + input_length, sizeof(input) - input_length - 1);
 
-	while (running) {
-		char * text = fgets(input, sizeof(input), stdin);
-		(void)text;
+	// Stop watching the console when the input is closed.
+	if (received <= 0) {
+		events_remove_fd(fd);
+		return;
 	}
 
-	return 0;
+	input_length += (size_t)received;
+	input[input_length] = 0;
+
+	// Parse every complete line in the buffer and keep the remainder for the next read.
+	char *line = input, *end;
+
+	while ((end = strchr(line, '\n')) != NULL) {
+		*end = 0;
+		config_parse_line(line);
+		line = end + 1;
+	}
+
+	input_length -= (size_t)(line - input);
+
+	// Discard the line if it doesn't fit in the buffer.
+	if (input_length >= sizeof(input) - 1) {
+		input_length = 0;
+	}
+
+	memmove(input, line, input_length);
 }
 
 MESSAGE_HANDLER(debug)
@@ -41,6 +66,8 @@ MESSAGE_HANDLER(debug)
 int main(int argc, char **argv)
 {
 	// Initialize subsystems.
+	events_initialize();
+	scheduler_initialize();
 	config_initialize();
 	messaging_initialize();
 	webapi_initialize();
@@ -56,28 +83,16 @@ int main(int argc, char **argv)
 	// Register a command for shutting down the process.
 	config_add_command_handler("quit", quit);
 
-	// Create a thread to read console input.
-	utils_thread_create(input_thread, NULL);
+	// Read console input on the event loop.
+	events_add_fd(STDIN_FILENO, EVENT_READ, process_console_input, NULL);
 
 	// Register a listener for debug messages pushed over MQTT.
 	messaging_subscribe(NULL, debug, "debug");
 #endif
 
+	// Sleep until a subsystem or module has something to do.
 	while (running) {
-
-#ifndef DAEMON
-		// Process console input if this is running as a regular process.
-		if (*input != 0) {
-			config_parse_line(input);
-			*input = 0;
-		}
-#endif
-
-		// Process subsystems and modules.
-		modules_process();
-		webapi_process();
-
-		// No need to sleep here because the web API blocks for 10ms.
+		events_process();
 	}
 
 	// Unload modules and shutdown subsystems.
@@ -85,6 +100,8 @@ int main(int argc, char **argv)
 	webapi_shutdown();
 	messaging_shutdown();
 	config_shutdown();
+	scheduler_shutdown();
+	events_shutdown();
 
 	return 0;
 }
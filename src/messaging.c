@@ -1,47 +1,233 @@
 #include "messaging.h"
 #include "config.h"
+#include "events.h"
 #include "logger.h"
 #include "main.h"
+#include "queue.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "topics.h"
 #include "utils.h"
+#include "webapi.h"
 #include "MQTTAsync.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 
 #define CLIENTID "smarthome_daemon"
 #define QOS 1
 
 static char mqtt_server[128];
 static uint16_t mqtt_port = 1883;
+static uint32_t mqtt_coalesce_window = 100; // ms
+static uint32_t mqtt_offline_buffer_size = 65536; // bytes
+static uint32_t mqtt_cache_size = 256; // topics
+
+// What to do when a message is published while disconnected and the offline buffer is full.
+enum {
+	OFFLINE_DROP_OLDEST,
+	OFFLINE_DROP_NEWEST,
+};
+
+static int mqtt_offline_drop_policy = OFFLINE_DROP_OLDEST;
 
 static MQTTAsync client;
 static bool is_connected = false;
 
-struct mqtt_subscription_t {
+// Connection state changes are reported on the MQTT client's threads and handled on the event loop.
+enum {
+	CONNECTION_ESTABLISHED = 0x1,
+	CONNECTION_LOST = 0x2,
+	CONNECTION_SUBSCRIBED = 0x4,
+	CONNECTION_FAILED = 0x8,
+};
+
+static int connection_wakeup = -1;
+static int connection_events = 0;
+
+// Reconnect attempts are delayed with a jittered exponential backoff, so a restarting server isn't flooded.
+#define RECONNECT_DELAY_MIN 1000 // ms
+#define RECONNECT_DELAY_MAX 60000 // ms
+
+static uint32_t reconnect_delay = 0;
+static uint32_t reconnect_timer = 0;
+static uint32_t reconnect_attempts = 0;
+
+// Messages published while the server is unreachable are kept in a preallocated ring and replayed in batches
+// once the connection is back. Messages published during the replay are queued after the buffered ones to keep the order.
+struct mqtt_offline_message_t {
+	uint32_t topic_length;
+	uint32_t payload_length;
+	char data[]; // Null terminated topic followed by the payload
+};
+
+#define OFFLINE_REPLAY_BATCH_SIZE 32
+
+static struct ring_t *offline_messages;
+static uint32_t replay_timer = 0;
+
+static struct {
+	uint64_t buffered;			// Number of messages stored while disconnected
+	uint64_t dropped;			// Number of messages lost because the buffer was full or disabled
+	uint64_t replayed;			// Number of buffered messages sent after reconnecting
+} offline_stats;
+
+// Inbound messages are received on the MQTT client's thread. They are passed to the event loop through
+// a lock-free queue and dispatched to the subscribers from there, so modules never run on the client's thread.
+struct mqtt_delivery_t {
 	char *topic;
+	MQTTAsync_message *message;
+	uint64_t received;
+};
+
+#define DELIVERY_QUEUE_SIZE 1024
+#define DELIVERY_BATCH_SIZE 64 // Max number of messages dispatched per event loop pass, so other events get their turn
+
+static struct queue_t *delivery_queue;
+static int delivery_wakeup = -1;
+static int delivery_wakeup_pending = 0;
+
+static struct {
+	uint64_t delivered;			// Number of messages dispatched to subscribers
+	uint64_t deferred;			// Number of times a message was left to the client because the queue was full
+	uint64_t latency_total;		// Total time messages have spent in the queue (ms)
+	uint64_t latency_max;		// Longest time a message has spent in the queue (ms)
+} delivery_stats;
+
+struct mqtt_dispatch_t {
+	struct message_topic_t *topic;
+	MQTTAsync_message *message;
+};
+
+struct mqtt_subscription_t {
+	struct message_topic_t *topic;
 	void* context;
 	message_update_t callback;
+	message_update_ex_t callback_ex;
 	struct mqtt_subscription_t *next;
+	struct mqtt_subscription_t *next_removed;	// Next subscription removed during the current dispatch
+};
+
+// Topics are interned into a tree indexed by topic level. The same tree is used to match inbound messages
+// to the subscriptions, so a topic filter is subscribed to on the server once for all of its subscribers.
+struct message_topic_t {
+	char *name;
+	uint32_t references;						// Number of handles to the topic given out to users
+	struct topic_node_t *node;
+	struct mqtt_subscription_t *subscriptions;
+
+	// Coalesced publishing. Values published while the window is open replace each other,
+	// and only the latest one is sent when the window closes.
+	uint64_t coalesce_until;
+	uint32_t flush_timer;
+	char *pending_payload;
+	int pending_length;
+
+	// Last value received to the topic. The payload is null terminated for convenience.
+	struct message_cached_t cached;
+	size_t cached_capacity;
+
+	// Topics released during a dispatch are kept until it ends, because the tree walk may still be on them.
+	bool release_pending;
+	struct message_topic_t *next_released;
+
+	// Position in the list of unused topics which are only kept for their cached value.
+	bool is_unused;
+	struct message_topic_t *unused_prev;
+	struct message_topic_t *unused_next;
+};
+
+static struct topic_tree_t *topics;
+static uint64_t cache_sequence = 0;
+
+// Handlers may unsubscribe or release topics while a message is being dispatched. Freeing the subscriptions
+// and pruning the tree is postponed until the dispatch is over.
+static bool is_dispatching = false;
+static struct mqtt_subscription_t *removed_subscriptions = NULL;
+static struct message_topic_t *released_topics = NULL;
+
+// Cached values of topics nobody has a handle to or is subscribed to are kept for the web API and module reloads,
+// but only for the mqtt_cache_size most recently updated topics. Older ones are evicted, oldest first.
+static struct {
+	struct message_topic_t *oldest;
+	struct message_topic_t *newest;
+	uint32_t count;
+} unused_topics;
+
+// After connecting, all the subscribed topic filters are registered to the server in batches
+// of SUBSCRIBE_BATCH_SIZE filters per SUBSCRIBE packet.
+#define SUBSCRIBE_BATCH_SIZE 64
+
+struct mqtt_subscribe_batch_t {
+	int count;
+	char *filters[SUBSCRIBE_BATCH_SIZE];
+	int qos[SUBSCRIBE_BATCH_SIZE];
 };
 
-struct mqtt_subscription_t *subscriptions = NULL;
+static struct {
+	uint64_t started;			// Time when the subscriptions were sent after connecting
+	uint64_t duration;			// Time it took to have all subscriptions acknowledged after the latest connect (ms)
+	uint32_t filters;			// Number of filters subscribed to after the latest connect
+	int pending;				// Number of batches still waiting for an acknowledgement
+	int failed;					// Number of batches the server refused
+} resubscribe;
+
+static struct {
+	uint64_t published;			// Number of messages handed to the MQTT client
+	uint64_t coalesced;			// Number of publishes replaced by a newer value before they were sent
+} publish_stats;
 
 // --------------------------------------------------------------------------------
 
 static void messaging_connect(void);
 static void messaging_disconnect(void);
-static struct mqtt_subscription_t *messaging_get_subscription(const char *topic, void *context, message_update_t callback);
+static void messaging_schedule_reconnect(void);
+static void messaging_send(const char *topic, void *payload, int payload_len);
+static void messaging_send_payload(const char *topic, void *payload, int payload_len);
+static void messaging_buffer_message(const char *topic, void *payload, int payload_len);
+static struct message_topic_t *messaging_get_topic(const char *name, bool create);
+static void messaging_release_unused_topic(struct message_topic_t *topic);
+static void messaging_flush_topic(struct message_topic_t *topic);
+static struct message_topic_t *messaging_cache_message(const char *topic, MQTTAsync_message *message, uint64_t received);
+static struct mqtt_subscription_t *messaging_get_subscription(struct message_topic_t *topic, void *context, message_update_t callback, message_update_ex_t callback_ex);
+static void messaging_add_subscription(struct message_topic_t *topic, void *context, message_update_t callback, message_update_ex_t callback_ex);
+static void messaging_remove_subscription(struct message_topic_t *topic, void *context, message_update_t callback, message_update_ex_t callback_ex);
 static void messaging_register_subscription(struct mqtt_subscription_t *sub);
 static void messaging_unregister_subscription(struct mqtt_subscription_t *sub);
+static void messaging_register_all(void);
+static void messaging_register_node(struct topic_node_t *node, void *context);
+static void messaging_send_subscribe_batch(struct mqtt_subscribe_batch_t *batch);
+static void messaging_on_subscribe_success(void *context, MQTTAsync_successData *response);
+static void messaging_on_subscribe_failure(void *context, MQTTAsync_failureData *response);
+static void messaging_on_subscribe_complete(void);
+static void messaging_destroy_node(struct topic_node_t *node, void *context);
+static void messaging_dispatch_node(struct topic_node_t *node, void *context);
 static void messaging_on_connect_success(void *context, MQTTAsync_successData *response);
 static void messaging_on_connect_failure(void *context, MQTTAsync_failureData *response);
 static void messaging_on_connection_lost(void *context, char *cause);
 static int messaging_on_message_arrived(void *context, char *topic, int topic_len, MQTTAsync_message *message);
 static void messaging_on_message_delivered(void *context, MQTTAsync_token token);
+static void messaging_dispatch_message(struct message_topic_t *topic, MQTTAsync_message *message);
+static void messaging_finish_dispatch(void);
+static void messaging_destroy_topic(struct message_topic_t *topic);
+static void messaging_link_unused_topic(struct message_topic_t *topic);
+static void messaging_unlink_unused_topic(struct message_topic_t *topic);
+
+EVENT_HANDLER(process_connection_events);
+EVENT_HANDLER(process_deliveries);
+WEB_API_HANDLER(messaging_process_api_request);
+TIMER_HANDLER(flush_coalesced_topic);
+TIMER_HANDLER(reconnect);
+TIMER_HANDLER(replay_offline_messages);
 
 CONFIG_HANDLER(set_mqtt_server);
 CONFIG_HANDLER(set_mqtt_port);
+CONFIG_HANDLER(set_mqtt_coalesce_window);
+CONFIG_HANDLER(set_mqtt_offline_buffer_size);
+CONFIG_HANDLER(set_mqtt_offline_drop_policy);
+CONFIG_HANDLER(set_mqtt_cache_size);
 
 // --------------------------------------------------------------------------------
 
@@ -50,12 +236,33 @@ void messaging_initialize(void)
 	// Register config setters for the MQTT server settings.
 	config_add_command_handler("mqtt_server", set_mqtt_server);
 	config_add_command_handler("mqtt_port", set_mqtt_port);
+	config_add_command_handler("mqtt_coalesce_window", set_mqtt_coalesce_window);
+	config_add_command_handler("mqtt_offline_buffer_size", set_mqtt_offline_buffer_size);
+	config_add_command_handler("mqtt_offline_drop_policy", set_mqtt_offline_drop_policy);
+	config_add_command_handler("mqtt_cache_size", set_mqtt_cache_size);
 
 	// Load the MQTT client config file.
 	char mqtt_config[260];
 	snprintf(mqtt_config, sizeof(mqtt_config), "%s/mqtt.conf", get_config_directory());
 	config_parse_file("./config/mqtt.conf");
 
+	topics = topic_tree_create();
+
+	if (mqtt_offline_buffer_size != 0) {
+		offline_messages = ring_create(mqtt_offline_buffer_size);
+	}
+
+	// Seed the reconnect jitter, so several daemons restarted at the same time won't reconnect in lockstep.
+	srand((unsigned int)time(NULL) ^ (unsigned int)utils_get_time_ms());
+
+	connection_wakeup = events_create_wakeup(process_connection_events, NULL);
+
+	delivery_queue = queue_create(DELIVERY_QUEUE_SIZE, sizeof(struct mqtt_delivery_t));
+	delivery_wakeup = events_create_wakeup(process_deliveries, NULL);
+
+	// Register a handler for web API requests.
+	webapi_register_interface("mqtt", messaging_process_api_request);
+
 	// If all the necessary settings are available, create an MQTT client and connect to the server.
 	if (*mqtt_server != 0) {
 		messaging_connect();
@@ -64,25 +271,58 @@ void messaging_initialize(void)
 
 void messaging_shutdown(void)
 {
+	scheduler_cancel_timer(reconnect_timer);
+	scheduler_cancel_timer(replay_timer);
+
+	reconnect_timer = 0;
+	replay_timer = 0;
+
 	if (is_connected) {
 		messaging_disconnect();
 	}
+	else if (client != NULL) {
+		MQTTAsync_destroy(&client);
+	}
 
-	// Destroy all subscriptions.
-	LIST_FOREACH_SAFE(struct mqtt_subscription_t, sub, tmp, subscriptions) {
-		utils_free(sub->topic);
-		utils_free(sub);
+	if (ring_count(offline_messages) != 0) {
+		output_log("Discarding %u unsent MQTT messages.", (uint32_t)ring_count(offline_messages));
+	}
+
+	ring_destroy(offline_messages);
+	offline_messages = NULL;
+
+	// Destroy all subscriptions and topics.
+	topic_tree_foreach(topics, messaging_destroy_node, NULL);
+	topic_tree_destroy(topics);
+
+	topics = NULL;
+	memset(&unused_topics, 0, sizeof(unused_topics));
+
+	if (connection_wakeup >= 0) {
+		events_remove_fd(connection_wakeup);
+		connection_wakeup = -1;
+	}
+
+	// Free the messages which were never dispatched, each allocated with its topic.
+	struct mqtt_delivery_t delivery;
+
+	while (queue_pop(delivery_queue, &delivery)) {
+		MQTTAsync_free(delivery.topic);
+	}
+
+	queue_destroy(delivery_queue);
+	delivery_queue = NULL;
+
+	if (delivery_wakeup >= 0) {
+		events_remove_fd(delivery_wakeup);
+		delivery_wakeup = -1;
 	}
 
-	subscriptions = NULL;
+	webapi_unregister_interface("mqtt");
 }
 
 void messaging_publish(const char *message, const char *topic_fmt, ...)
 {
-	if (!is_connected) {
-		return;
-	}
-
 	char topic[256];
 	va_list args;
 
@@ -90,24 +330,11 @@ void messaging_publish(const char *message, const char *topic_fmt, ...)
 	vsnprintf(topic, sizeof(topic), topic_fmt, args);
 	va_end(args);
 
-	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
-	opts.context = client;
-
-	MQTTAsync_message msg = MQTTAsync_message_initializer;
-	msg.payload = (void *)message;
-	msg.payloadlen = (int)strlen(message) + 1;
-	msg.qos = QOS;
-	msg.retained = 0;
-
-	MQTTAsync_sendMessage(client, topic, &msg, &opts);
+	messaging_send(topic, (void *)message, (int)strlen(message) + 1);
 }
 
 void messaging_publish_data(void *data, size_t data_size, const char *topic_fmt, ...)
 {
-	if (!is_connected) {
-		return;
-	}
-
 	char topic[256];
 	va_list args;
 
@@ -115,16 +342,7 @@ void messaging_publish_data(void *data, size_t data_size, const char *topic_fmt,
 	vsnprintf(topic, sizeof(topic), topic_fmt, args);
 	va_end(args);
 
-	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
-	opts.context = client;
-
-	MQTTAsync_message msg = MQTTAsync_message_initializer;
-	msg.payload = data;
-	msg.payloadlen = (int)data_size;
-	msg.qos = QOS;
-	msg.retained = 0;
-
-	MQTTAsync_sendMessage(client, topic, &msg, &opts);
+	messaging_send(topic, data, (int)data_size);
 }
 
 void messaging_subscribe(void *context, message_update_t callback, const char *topic_fmt, ...)
@@ -136,27 +354,29 @@ void messaging_subscribe(void *context, message_update_t callback, const char *t
 	vsnprintf(topic, sizeof(topic), topic_fmt, args);
 	va_end(args);
 
-	// Add to the list of subscriptions and then actually subscribe if connected.
-	// If the subscription has been added already, don't do anything.
-	struct mqtt_subscription_t *sub = messaging_get_subscription(topic, context, callback);
+	struct message_topic_t *entry = messaging_get_topic(topic, true);
 
-	if (sub != NULL) {
-		return;
-	}
+	messaging_subscribe_topic(context, callback, entry);
+	messaging_release_unused_topic(entry);
+}
 
-	sub = utils_alloc(sizeof(*sub));
-	sub->topic = utils_duplicate_string(topic);
-	sub->context = context;
-	sub->callback = callback;
+void messaging_unsubscribe(void *context, message_update_t callback, const char *topic_fmt, ...)
+{
+	char topic[256];
+	va_list args;
 
-	LIST_ADD_ENTRY(subscriptions, sub);
+	va_start(args, topic_fmt);
+	vsnprintf(topic, sizeof(topic), topic_fmt, args);
+	va_end(args);
 
-	if (is_connected) {
-		messaging_register_subscription(sub);
+	struct message_topic_t *entry = messaging_get_topic(topic, false);
+
+	if (entry != NULL) {
+		messaging_unsubscribe_topic(context, callback, entry);
 	}
 }
 
-void messaging_unsubscribe(void *context, message_update_t callback, const char *topic_fmt, ...)
+struct message_topic_t *messaging_intern_topic(const char *topic_fmt, ...)
 {
 	char topic[256];
 	va_list args;
@@ -165,171 +385,1129 @@ void messaging_unsubscribe(void *context, message_update_t callback, const char
 	vsnprintf(topic, sizeof(topic), topic_fmt, args);
 	va_end(args);
 
-	struct mqtt_subscription_t *sub = messaging_get_subscription(topic, context, callback);
+	struct message_topic_t *entry = messaging_get_topic(topic, true);
+	++entry->references;
 
-	if (sub == NULL) {
+	messaging_unlink_unused_topic(entry);
+
+	return entry;
+}
+
+void messaging_release_topic(struct message_topic_t *topic)
+{
+	if (topic == NULL || topic->references == 0) {
 		return;
 	}
 
-	// Actually unsubscribe if connected, then remove from the list and destroy.
-	if (is_connected) {
-		messaging_unregister_subscription(sub);
+	--topic->references;
+	messaging_release_unused_topic(topic);
+}
+
+void messaging_publish_topic(struct message_topic_t *topic, const char *message)
+{
+	if (topic == NULL) {
+		return;
 	}
 
-	LIST_REMOVE_ENTRY(struct mqtt_subscription_t, sub, subscriptions);
+	messaging_send(topic->name, (void *)message, (int)strlen(message) + 1);
+}
+
+void messaging_publish_topic_data(struct message_topic_t *topic, void *data, size_t data_size)
+{
+	if (topic == NULL) {
+		return;
+	}
 
-	utils_free(sub->topic);
-	utils_free(sub);
+	messaging_send(topic->name, data, (int)data_size);
 }
 
-static void messaging_connect(void)
+void messaging_publish_topic_coalesced(struct message_topic_t *topic, const char *message)
 {
-	if (is_connected) {
+	if (topic == NULL) {
 		return;
 	}
 
-	MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
-	//MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer;
+	int length = (int)strlen(message) + 1;
+	uint64_t now = utils_get_time_ms();
 
-	char address[160];
-	snprintf(address, sizeof(address), "tcp://%s:%u", mqtt_server, mqtt_port);
+	// Nothing has been published to the topic recently, send the value right away and open a new window.
+	if (topic->pending_payload == NULL && now >= topic->coalesce_until) {
 
-	output_log("Connecting to MQTT server %s...", address);
+		messaging_send(topic->name, (void *)message, length);
+		topic->coalesce_until = now + mqtt_coalesce_window;
 
-	MQTTAsync_create(&client, address, CLIENTID, MQTTCLIENT_PERSISTENCE_NONE, NULL);
-	MQTTAsync_setCallbacks(client, NULL, messaging_on_connection_lost, messaging_on_message_arrived, messaging_on_message_delivered);
+		return;
+	}
 
-	conn_opts.keepAliveInterval = 20;
-	conn_opts.cleansession = 1;
-	conn_opts.onSuccess = messaging_on_connect_success;
-	conn_opts.onFailure = messaging_on_connect_failure;
-	conn_opts.context = client;
+	// Otherwise store the value to be sent when the window closes, replacing any older value still waiting.
+	if (topic->pending_payload != NULL) {
+
+		messaging_free_payload(topic->pending_payload);
+		++publish_stats.coalesced;
+	}
+	else {
+		topic->flush_timer = scheduler_add_timer((uint32_t)(topic->coalesce_until - now), 0, flush_coalesced_topic, topic);
+	}
+
+	topic->pending_payload = messaging_alloc_payload((size_t)length);
+	topic->pending_length = length;
 
-	MQTTAsync_connect(client, &conn_opts);
+	memcpy(topic->pending_payload, message, (size_t)length);
 }
 
-static void messaging_disconnect(void)
+const struct message_cached_t *messaging_get_cached(struct message_topic_t *topic)
 {
-	if (!is_connected) {
-		return;
+	if (topic == NULL || topic->cached.payload == NULL) {
+		return NULL;
 	}
 
-	MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
-	opts.context = client;
+	return &topic->cached;
+}
 
-	MQTTAsync_disconnect(client, &opts);
-	MQTTAsync_destroy(&client);
-	
-	is_connected = false;
+void messaging_subscribe_topic(void *context, message_update_t callback, struct message_topic_t *topic)
+{
+	messaging_add_subscription(topic, context, callback, NULL);
 }
 
-static struct mqtt_subscription_t *messaging_get_subscription(const char *topic, void *context, message_update_t callback)
+void messaging_unsubscribe_topic(void *context, message_update_t callback, struct message_topic_t *topic)
 {
-	LIST_FOREACH(struct mqtt_subscription_t, sub, subscriptions) {
-		if (strcmp(topic, sub->topic) == 0 &&
-			sub->context == context &&
-			sub->callback == callback) {
-			return sub;
-		}
+	messaging_remove_subscription(topic, context, callback, NULL);
+}
+
+void messaging_subscribe_ex(void *context, message_update_ex_t callback, struct message_topic_t *topic)
+{
+	messaging_add_subscription(topic, context, NULL, callback);
+}
+
+void messaging_unsubscribe_ex(void *context, message_update_ex_t callback, struct message_topic_t *topic)
+{
+	messaging_remove_subscription(topic, context, NULL, callback);
+}
+
+const char *messaging_get_topic_name(struct message_topic_t *topic)
+{
+	return (topic != NULL ? topic->name : NULL);
+}
+
+void *messaging_alloc_payload(size_t size)
+{
+	// Payloads are allocated by the MQTT client, so it can take them over and free them itself once they have been sent.
+	void *payload = MQTTAsync_malloc(size != 0 ? size : 1);
+
+	if (payload == NULL) {
+		output_error("Unable to allocate memory");
+		exit(0);
 	}
 
-	return NULL;
+	return payload;
 }
 
-static void messaging_register_subscription(struct mqtt_subscription_t *sub)
+void messaging_free_payload(void *payload)
 {
-	if (!is_connected || sub == NULL) {
-		return;
+	if (payload != NULL) {
+		MQTTAsync_free(payload);
 	}
+}
 
-	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
-	opts.onSuccess = NULL;
-	opts.onFailure = NULL;
-	opts.context = client;
+void messaging_publish_payload(void *payload, size_t payload_size, const char *topic_fmt, ...)
+{
+	char topic[256];
+	va_list args;
+
+	va_start(args, topic_fmt);
+	vsnprintf(topic, sizeof(topic), topic_fmt, args);
+	va_end(args);
 
-	MQTTAsync_subscribe(client, sub->topic, QOS, &opts);
+	messaging_send_payload(topic, payload, (int)payload_size);
 }
 
-static void messaging_unregister_subscription(struct mqtt_subscription_t *sub)
+void messaging_publish_topic_payload(struct message_topic_t *topic, void *payload, size_t payload_size)
 {
-	if (!is_connected || sub == NULL) {
+	if (topic == NULL) {
+		messaging_free_payload(payload);
 		return;
 	}
 
-	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
-	opts.onSuccess = NULL;
-	opts.onFailure = NULL;
-	opts.context = client;
-
-	MQTTAsync_unsubscribe(client, sub->topic, &opts);
+	messaging_send_payload(topic->name, payload, (int)payload_size);
 }
 
-static void messaging_on_connect_success(void *context, MQTTAsync_successData *response)
+static void messaging_add_subscription(struct message_topic_t *topic, void *context, message_update_t callback, message_update_ex_t callback_ex)
 {
-	is_connected = true;
+	if (topic == NULL) {
+		return;
+	}
+
+	// Add to the list of subscriptions and then actually subscribe if connected.
+	// If the subscription has been added already, don't do anything.
+	struct mqtt_subscription_t *sub = messaging_get_subscription(topic, context, callback, callback_ex);
+
+	if (sub != NULL) {
+		return;
+	}
+
+	sub = utils_alloc(sizeof(*sub));
+	sub->topic = topic;
+	sub->context = context;
+	sub->callback = callback;
+	sub->callback_ex = callback_ex;
+
+	bool is_new_filter = (topic->subscriptions == NULL);
 
-	output_log("Connected to MQTT server.");
+	LIST_ADD_ENTRY(topic->subscriptions, sub);
+	messaging_unlink_unused_topic(topic);
 
-	// Register all existing subscriptions on connect.
-	LIST_FOREACH(struct mqtt_subscription_t, sub, subscriptions) {
+	// Only the first subscription to a filter has to be registered to the server.
+	if (is_connected && is_new_filter) {
 		messaging_register_subscription(sub);
 	}
 }
 
-static void messaging_on_connect_failure(void *context, MQTTAsync_failureData *response)
+static void messaging_remove_subscription(struct message_topic_t *topic, void *context, message_update_t callback, message_update_ex_t callback_ex)
 {
-	is_connected = false;
+	if (topic == NULL) {
+		return;
+	}
 
-	output_log("Could not connect to MQTT server!");
-}
+	struct mqtt_subscription_t *sub = messaging_get_subscription(topic, context, callback, callback_ex);
 
-static void messaging_on_connection_lost(void *context, char *cause)
-{
-	is_connected = false;
+	if (sub == NULL) {
+		return;
+	}
 
-	// It seems we have lost connection to the MQTT server for whatever reason, let's try again.
-	output_log("Lost connection to MQTT server. Attempting to reconnect.");
-	MQTTAsync_destroy(&client);
+	// Remove from the list of subscriptions to the filter, then actually unsubscribe if nobody is using it anymore.
+	LIST_REMOVE_ENTRY(struct mqtt_subscription_t, sub, topic->subscriptions);
 
-	messaging_connect();
+	if (topic->subscriptions == NULL && is_connected) {
+		messaging_unregister_subscription(sub);
+	}
+
+	if (is_dispatching) {
+
+		// The dispatch may be on this subscription right now. Make sure it isn't called again and free it later.
+		sub->callback = NULL;
+		sub->callback_ex = NULL;
+		sub->next_removed = removed_subscriptions;
+		removed_subscriptions = sub;
+	}
+	else {
+		utils_free(sub);
+	}
+
+	messaging_release_unused_topic(topic);
 }
 
-static int messaging_on_message_arrived(void *context, char *topic, int topic_len, MQTTAsync_message *message)
+static void messaging_send(const char *topic, void *payload, int payload_len)
 {
-	// Notify all listeners about the updated topic.
-	LIST_FOREACH(struct mqtt_subscription_t, sub, subscriptions) {
-		if (strcmp(sub->topic, topic) == 0 && sub->callback != NULL) {
-			sub->callback(topic, (const char *)message->payload, sub->context);
-		}
+	// Keep the message for later if the server is unreachable or older messages are still waiting to be replayed.
+	if (!is_connected || ring_count(offline_messages) != 0) {
+		messaging_buffer_message(topic, payload, payload_len);
+		return;
 	}
 
-	// Free the message data.
-	MQTTAsync_freeMessage(&message);
-	MQTTAsync_free(topic);
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	opts.context = client;
+
+	MQTTAsync_message msg = MQTTAsync_message_initializer;
+	msg.payload = payload;
+	msg.payloadlen = payload_len;
+	msg.qos = QOS;
+	msg.retained = 0;
+
+	if (MQTTAsync_sendMessage(client, topic, &msg, &opts) != MQTTASYNC_SUCCESS) {
+		messaging_buffer_message(topic, payload, payload_len);
+		return;
+	}
 
-	return 1;
+	++publish_stats.published;
 }
 
-static void messaging_on_message_delivered(void *context, MQTTAsync_token token)
+static void messaging_send_payload(const char *topic, void *payload, int payload_len)
 {
+	// Hand the payload over to the client, which frees it once the message has been delivered.
+	// If the client won't take it, the message is copied to the offline buffer instead.
+	if (is_connected && ring_count(offline_messages) == 0) {
+
+		MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+		opts.context = client;
+
+		if (MQTTAsync_sendOwned(client, topic, payload_len, payload, QOS, 0, &opts) == MQTTASYNC_SUCCESS) {
+			++publish_stats.published;
+			return;
+		}
+	}
+
+	messaging_buffer_message(topic, payload, payload_len);
+	MQTTAsync_free(payload);
 }
 
-CONFIG_HANDLER(set_mqtt_server)
+static void messaging_buffer_message(const char *topic, void *payload, int payload_len)
 {
-	if (*args == 0) {
-		output_log("Usage: mqtt_server <ip address>");
+	if (offline_messages == NULL) {
+		++offline_stats.dropped;
 		return;
 	}
 
-	snprintf(mqtt_server, sizeof(mqtt_server), "%s", args);
-}
+	size_t topic_length = strlen(topic);
+	size_t size = sizeof(struct mqtt_offline_message_t) + topic_length + 1 + (size_t)payload_len;
 
-CONFIG_HANDLER(set_mqtt_port)
-{
-	if (*args == 0) {
-		output_log("Usage: mqtt_port <port>");
+	// A message which wouldn't fit even in an empty buffer must not push out the ones which do.
+	if (size > ring_max_record_size(offline_messages)) {
+		++offline_stats.dropped;
 		return;
 	}
 
-	mqtt_port = (uint16_t)atoi(args);
+	struct mqtt_offline_message_t *message = ring_push(offline_messages, size);
+
+	// Make room for the new message by dropping the oldest ones, unless the policy says to drop the new one instead.
+	while (message == NULL && mqtt_offline_drop_policy == OFFLINE_DROP_OLDEST && ring_count(offline_messages) != 0) {
+
+		ring_pop(offline_messages);
+		++offline_stats.dropped;
+
+		message = ring_push(offline_messages, size);
+	}
+
+	if (message == NULL) {
+		++offline_stats.dropped;
+		return;
+	}
+
+	message->topic_length = (uint32_t)topic_length;
+	message->payload_length = (uint32_t)payload_len;
+
+	memcpy(message->data, topic, topic_length + 1);
+	memcpy(message->data + topic_length + 1, payload, (size_t)payload_len);
+
+	++offline_stats.buffered;
+
+	// The client refused the message while connected. Retry a bit later, otherwise nothing would send
+	// the buffered messages before the next reconnect.
+	if (is_connected && replay_timer == 0) {
+		replay_timer = scheduler_add_timer(RECONNECT_DELAY_MIN, 0, replay_offline_messages, NULL);
+	}
+}
+
+TIMER_HANDLER(replay_offline_messages)
+{
+	replay_timer = 0;
+
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	opts.context = client;
+
+	MQTTAsync_message msg = MQTTAsync_message_initializer;
+	msg.qos = QOS;
+	msg.retained = 0;
+
+	struct mqtt_offline_message_t *message;
+
+	// Hand a batch of messages to the client without waiting for acknowledgements, then let the event loop
+	// process other events before continuing with the next batch.
+	for (int count = 0; count < OFFLINE_REPLAY_BATCH_SIZE && is_connected; ++count) {
+
+		if ((message = ring_peek(offline_messages, NULL)) == NULL) {
+			return;
+		}
+
+		msg.payload = message->data + message->topic_length + 1;
+		msg.payloadlen = (int)message->payload_length;
+
+		// The client copies the message, so it can be removed from the ring right away.
+		// If the client can't take it right now, try again a bit later. Any other error means the message
+		// will never be accepted, so drop it instead of letting it block the rest of the buffer.
+		int rc = MQTTAsync_sendMessage(client, message->data, &msg, &opts);
+
+		if (rc == MQTTASYNC_MAX_BUFFERED_MESSAGES || rc == MQTTASYNC_NO_MORE_MSGIDS || rc == MQTTASYNC_DISCONNECTED) {
+			replay_timer = scheduler_add_timer(RECONNECT_DELAY_MIN, 0, replay_offline_messages, NULL);
+			return;
+		}
+
+		ring_pop(offline_messages);
+
+		if (rc != MQTTASYNC_SUCCESS) {
+			++offline_stats.dropped;
+			continue;
+		}
+
+		++offline_stats.replayed;
+		++publish_stats.published;
+	}
+
+	if (is_connected && ring_count(offline_messages) != 0) {
+		replay_timer = scheduler_add_timer(0, 0, replay_offline_messages, NULL);
+	}
+}
+
+static struct message_topic_t *messaging_get_topic(const char *name, bool create)
+{
+	struct topic_node_t *node = topic_tree_find(topics, name, create);
+
+	if (node == NULL) {
+		return NULL;
+	}
+
+	struct message_topic_t *topic = topic_node_get_data(node);
+
+	if (topic == NULL && create) {
+
+		topic = utils_alloc(sizeof(*topic));
+		topic->name = utils_duplicate_string(name);
+		topic->node = node;
+
+		// The name stays the same for the lifetime of the topic, so the client only needs to validate it once.
+		MQTTAsync_registerTopic(topic->name);
+
+		topic_node_set_data(node, topic);
+	}
+
+	return topic;
+}
+
+static void messaging_release_unused_topic(struct message_topic_t *topic)
+{
+	// Keep the topic around while someone still has a handle to it or is subscribed to it.
+	if (topic->references != 0 || topic->subscriptions != NULL) {
+		return;
+	}
+
+	// The dispatch may still be walking the topic's node, prune it once the dispatch is over.
+	if (is_dispatching) {
+
+		if (!topic->release_pending) {
+			topic->release_pending = true;
+			topic->next_released = released_topics;
+			released_topics = topic;
+		}
+		return;
+	}
+
+	// Don't lose the latest value if the topic is released before its coalescing window closes.
+	messaging_flush_topic(topic);
+
+	if (topic->cached.payload == NULL || mqtt_cache_size == 0) {
+		messaging_destroy_topic(topic);
+		return;
+	}
+
+	// Keep the cached value for a while, and make room for it by evicting the topics which were updated the longest ago.
+	messaging_unlink_unused_topic(topic);
+	messaging_link_unused_topic(topic);
+
+	while (unused_topics.count > mqtt_cache_size) {
+		messaging_destroy_topic(unused_topics.oldest);
+	}
+}
+
+static void messaging_destroy_topic(struct message_topic_t *topic)
+{
+	messaging_unlink_unused_topic(topic);
+
+	topic_node_set_data(topic->node, NULL);
+	topic_tree_prune(topics, topic->node);
+
+	if (topic->cached.payload != NULL) {
+		utils_free((char *)topic->cached.payload);
+	}
+
+	MQTTAsync_unregisterTopic(topic->name);
+	utils_free(topic->name);
+	utils_free(topic);
+}
+
+static void messaging_link_unused_topic(struct message_topic_t *topic)
+{
+	topic->is_unused = true;
+	topic->unused_prev = unused_topics.newest;
+	topic->unused_next = NULL;
+
+	if (unused_topics.newest != NULL) {
+		unused_topics.newest->unused_next = topic;
+	}
+	else {
+		unused_topics.oldest = topic;
+	}
+
+	unused_topics.newest = topic;
+	++unused_topics.count;
+}
+
+static void messaging_unlink_unused_topic(struct message_topic_t *topic)
+{
+	if (!topic->is_unused) {
+		return;
+	}
+
+	if (topic->unused_prev != NULL) {
+		topic->unused_prev->unused_next = topic->unused_next;
+	}
+	else {
+		unused_topics.oldest = topic->unused_next;
+	}
+
+	if (topic->unused_next != NULL) {
+		topic->unused_next->unused_prev = topic->unused_prev;
+	}
+	else {
+		unused_topics.newest = topic->unused_prev;
+	}
+
+	topic->is_unused = false;
+	topic->unused_prev = NULL;
+	topic->unused_next = NULL;
+	--unused_topics.count;
+}
+
+static void messaging_connect(void)
+{
+	if (is_connected) {
+		return;
+	}
+
+	MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+	//MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer;
+
+	char address[160];
+	snprintf(address, sizeof(address), "tcp://%s:%u", mqtt_server, mqtt_port);
+
+	output_log("Connecting to MQTT server %s...", address);
+
+	++reconnect_attempts;
+
+	MQTTAsync_create(&client, address, CLIENTID, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	MQTTAsync_setCallbacks(client, NULL, messaging_on_connection_lost, messaging_on_message_arrived, messaging_on_message_delivered);
+
+	// Received messages stay in the buffer they were read into, as one allocation with their topic.
+	MQTTAsync_setZeroCopyReceive(client, 1);
+
+	conn_opts.keepAliveInterval = 20;
+	conn_opts.cleansession = 1;
+	conn_opts.onSuccess = messaging_on_connect_success;
+	conn_opts.onFailure = messaging_on_connect_failure;
+	conn_opts.context = client;
+
+	if (MQTTAsync_connect(client, &conn_opts) != MQTTASYNC_SUCCESS) {
+
+		MQTTAsync_destroy(&client);
+		messaging_schedule_reconnect();
+	}
+}
+
+static void messaging_schedule_reconnect(void)
+{
+	if (reconnect_timer != 0) {
+		return;
+	}
+
+	// Double the delay after every failed attempt, and pick the actual delay randomly from the upper half of it.
+	reconnect_delay = (reconnect_delay == 0 ? RECONNECT_DELAY_MIN : reconnect_delay * 2);
+
+	if (reconnect_delay > RECONNECT_DELAY_MAX) {
+		reconnect_delay = RECONNECT_DELAY_MAX;
+	}
+
+	uint32_t delay = reconnect_delay / 2 + (uint32_t)rand() % (reconnect_delay / 2 + 1);
+
+	output_log("Reconnecting to MQTT server in %u ms.", delay);
+	reconnect_timer = scheduler_add_timer(delay, 0, reconnect, NULL);
+}
+
+TIMER_HANDLER(reconnect)
+{
+	reconnect_timer = 0;
+	messaging_connect();
+}
+
+static void messaging_disconnect(void)
+{
+	if (!is_connected) {
+		return;
+	}
+
+	MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
+	opts.context = client;
+
+	MQTTAsync_disconnect(client, &opts);
+	MQTTAsync_destroy(&client);
+	
+	is_connected = false;
+}
+
+static struct mqtt_subscription_t *messaging_get_subscription(struct message_topic_t *topic, void *context, message_update_t callback, message_update_ex_t callback_ex)
+{
+	LIST_FOREACH(struct mqtt_subscription_t, sub, topic->subscriptions) {
+		if (sub->context == context &&
+			sub->callback == callback &&
+			sub->callback_ex == callback_ex) {
+			return sub;
+		}
+	}
+
+	return NULL;
+}
+
+static void messaging_register_subscription(struct mqtt_subscription_t *sub)
+{
+	if (!is_connected || sub == NULL) {
+		return;
+	}
+
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	opts.onSuccess = NULL;
+	opts.onFailure = NULL;
+	opts.context = client;
+
+	MQTTAsync_subscribe(client, sub->topic->name, QOS, &opts);
+}
+
+static void messaging_unregister_subscription(struct mqtt_subscription_t *sub)
+{
+	if (!is_connected || sub == NULL) {
+		return;
+	}
+
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	opts.onSuccess = NULL;
+	opts.onFailure = NULL;
+	opts.context = client;
+
+	MQTTAsync_unsubscribe(client, sub->topic->name, &opts);
+}
+
+static void messaging_on_connect_success(void *context, MQTTAsync_successData *response)
+{
+	__atomic_fetch_or(&connection_events, CONNECTION_ESTABLISHED, __ATOMIC_RELEASE);
+	events_signal_wakeup(connection_wakeup);
+}
+
+static void messaging_on_connect_failure(void *context, MQTTAsync_failureData *response)
+{
+	__atomic_fetch_or(&connection_events, CONNECTION_FAILED, __ATOMIC_RELEASE);
+	events_signal_wakeup(connection_wakeup);
+}
+
+static void messaging_on_connection_lost(void *context, char *cause)
+{
+	__atomic_fetch_or(&connection_events, CONNECTION_LOST, __ATOMIC_RELEASE);
+	events_signal_wakeup(connection_wakeup);
+}
+
+EVENT_HANDLER(process_connection_events)
+{
+	int pending = __atomic_exchange_n(&connection_events, 0, __ATOMIC_ACQUIRE);
+
+	if (pending & (CONNECTION_LOST | CONNECTION_FAILED)) {
+
+		if (pending & CONNECTION_LOST) {
+			// It seems we have lost connection to the MQTT server for whatever reason, let's try again.
+			output_log("Lost connection to MQTT server.");
+		}
+		else {
+			output_log("Could not connect to MQTT server!");
+		}
+
+		is_connected = false;
+		MQTTAsync_destroy(&client);
+
+		messaging_schedule_reconnect();
+	}
+	else if (pending & CONNECTION_ESTABLISHED) {
+
+		is_connected = true;
+		reconnect_delay = 0;
+
+		output_log("Connected to MQTT server.");
+
+		// Register all existing subscriptions on connect, then send everything that was published while disconnected.
+		messaging_register_all();
+
+		if (ring_count(offline_messages) != 0 && replay_timer == 0) {
+
+			output_log("Sending %u messages published while disconnected.", (uint32_t)ring_count(offline_messages));
+			replay_timer = scheduler_add_timer(0, 0, replay_offline_messages, NULL);
+		}
+	}
+	else if (pending & CONNECTION_SUBSCRIBED) {
+		messaging_on_subscribe_complete();
+	}
+}
+
+static int messaging_on_message_arrived(void *context, char *topic, int topic_len, MQTTAsync_message *message)
+{
+	// Called on the MQTT client's thread. Take ownership of the message and queue it for the event loop.
+	struct mqtt_delivery_t delivery;
+	delivery.topic = topic;
+	delivery.message = message;
+	delivery.received = utils_get_time_ms();
+
+	if (!queue_push(delivery_queue, &delivery)) {
+
+		// The queue is full. Returning false leaves the message to the client, which will offer it again later.
+		__atomic_fetch_add(&delivery_stats.deferred, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// Only wake up the event loop if it isn't about to process the queue already.
+	if (__atomic_exchange_n(&delivery_wakeup_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		events_signal_wakeup(delivery_wakeup);
+	}
+
+	return 1;
+}
+
+EVENT_HANDLER(process_deliveries)
+{
+	// Clear the pending flag before draining, so messages queued from now on will signal a new wakeup.
+	__atomic_store_n(&delivery_wakeup_pending, 0, __ATOMIC_RELEASE);
+
+	uint64_t now = utils_get_time_ms();
+	struct mqtt_delivery_t delivery;
+	int count = 0;
+
+	while (count < DELIVERY_BATCH_SIZE && queue_pop(delivery_queue, &delivery)) {
+
+		uint64_t latency = (now > delivery.received ? now - delivery.received : 0);
+
+		delivery_stats.latency_total += latency;
+		delivery_stats.latency_max = (latency > delivery_stats.latency_max ? latency : delivery_stats.latency_max);
+		++delivery_stats.delivered;
+		++count;
+
+		struct message_topic_t *topic = messaging_cache_message(delivery.topic, delivery.message, delivery.received);
+
+		// Hold on to the topic while the handlers run, they may unsubscribe from it or release it.
+		// Like any topic in use, it must not be evicted from the unused topics meanwhile.
+		++topic->references;
+		messaging_unlink_unused_topic(topic);
+
+		messaging_dispatch_message(topic, delivery.message);
+		--topic->references;
+
+		// Topics nobody uses only go to the bounded list of recent values, or are freed right away.
+		messaging_release_unused_topic(topic);
+
+		// The message and its payload were allocated with the topic, free them all at once.
+		MQTTAsync_free(delivery.topic);
+	}
+
+	// If the batch limit was reached, come back for the rest on the next pass.
+	if (count == DELIVERY_BATCH_SIZE && queue_count(delivery_queue) > 0 &&
+		__atomic_exchange_n(&delivery_wakeup_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		events_signal_wakeup(delivery_wakeup);
+	}
+}
+
+static struct message_topic_t *messaging_cache_message(const char *topic, MQTTAsync_message *message, uint64_t received)
+{
+	struct message_topic_t *entry = messaging_get_topic(topic, true);
+	size_t length = (message->payloadlen > 0 ? (size_t)message->payloadlen : 0);
+
+	// Reuse the buffer of the previous value when the new one fits.
+	if (entry->cached.payload == NULL || length + 1 > entry->cached_capacity) {
+
+		if (entry->cached.payload != NULL) {
+			utils_free((char *)entry->cached.payload);
+		}
+
+		entry->cached.payload = utils_alloc(length + 1);
+		entry->cached_capacity = length + 1;
+	}
+
+	char *payload = (char *)entry->cached.payload;
+
+	memcpy(payload, message->payload, length);
+	payload[length] = 0;
+
+	entry->cached.length = length;
+	entry->cached.timestamp = received;
+	entry->cached.sequence = ++cache_sequence;
+
+	return entry;
+}
+
+static void messaging_dispatch_message(struct message_topic_t *topic, MQTTAsync_message *message)
+{
+	// Notify all listeners whose topic filter matches the updated topic.
+	struct mqtt_dispatch_t dispatch;
+	dispatch.topic = topic;
+	dispatch.message = message;
+
+	is_dispatching = true;
+	topic_tree_match(topics, topic->name, messaging_dispatch_node, &dispatch);
+	is_dispatching = false;
+
+	messaging_finish_dispatch();
+}
+
+static void messaging_finish_dispatch(void)
+{
+	// Free what the handlers unsubscribed and released while the dispatch was running.
+	LIST_FOREACH_SAFE(struct mqtt_subscription_t, sub, tmp, removed_subscriptions) {
+		tmp = sub->next_removed;
+		utils_free(sub);
+	}
+
+	removed_subscriptions = NULL;
+
+	LIST_FOREACH_SAFE(struct message_topic_t, topic, tmp, released_topics) {
+
+		tmp = topic->next_released;
+
+		// The topic may have been taken into use again after it was released.
+		topic->release_pending = false;
+		messaging_release_unused_topic(topic);
+	}
+
+	released_topics = NULL;
+}
+
+static void messaging_dispatch_node(struct topic_node_t *node, void *context)
+{
+	struct mqtt_dispatch_t *dispatch = context;
+	struct message_topic_t *filter = topic_node_get_data(node);
+	struct message_topic_t *topic = dispatch->topic;
+
+	LIST_FOREACH(struct mqtt_subscription_t, sub, filter->subscriptions) {
+
+		if (sub->callback_ex != NULL) {
+			// Extended handlers get the payload straight from the client's buffer.
+			sub->callback_ex(topic, dispatch->message->payload, (size_t)dispatch->message->payloadlen, sub->context);
+		}
+		else if (sub->callback != NULL) {
+			// Handlers with the old signature expect a null terminated string, which the payload isn't guaranteed to be.
+			// Pass them the terminated copy in the cache instead.
+			sub->callback(topic->name, topic->cached.payload, sub->context);
+		}
+	}
+}
+
+static void messaging_flush_topic(struct message_topic_t *topic)
+{
+	if (topic->pending_payload == NULL) {
+		return;
+	}
+
+	scheduler_cancel_timer(topic->flush_timer);
+	topic->flush_timer = 0;
+
+	// The client takes over the pending payload.
+	messaging_send_payload(topic->name, topic->pending_payload, topic->pending_length);
+	topic->pending_payload = NULL;
+}
+
+TIMER_HANDLER(flush_coalesced_topic)
+{
+	struct message_topic_t *topic = context;
+
+	// The timer has fired, don't try to cancel it when flushing.
+	topic->flush_timer = 0;
+
+	messaging_flush_topic(topic);
+
+	// Values published during the next window are coalesced again.
+	topic->coalesce_until = utils_get_time_ms() + mqtt_coalesce_window;
+}
+
+static void messaging_register_all(void)
+{
+	struct mqtt_subscribe_batch_t batch;
+	batch.count = 0;
+
+	resubscribe.started = utils_get_time_ms();
+	resubscribe.filters = 0;
+	resubscribe.failed = 0;
+
+	// Hold an extra reference to the pending batch count while the batches are being sent,
+	// so acknowledgements arriving in the meantime won't complete the resubscription early.
+	__atomic_store_n(&resubscribe.pending, 1, __ATOMIC_RELEASE);
+
+	topic_tree_foreach(topics, messaging_register_node, &batch);
+	messaging_send_subscribe_batch(&batch);
+
+	if (__atomic_sub_fetch(&resubscribe.pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		messaging_on_subscribe_complete();
+	}
+}
+
+static void messaging_register_node(struct topic_node_t *node, void *context)
+{
+	struct mqtt_subscribe_batch_t *batch = context;
+	struct message_topic_t *topic = topic_node_get_data(node);
+
+	// Topics which are only published to don't need to be registered. Each filter is in the tree only once,
+	// so it is subscribed to only once no matter how many subscribers it has.
+	if (topic->subscriptions == NULL) {
+		return;
+	}
+
+	batch->filters[batch->count] = topic->name;
+	batch->qos[batch->count] = QOS;
+
+	if (++batch->count == SUBSCRIBE_BATCH_SIZE) {
+		messaging_send_subscribe_batch(batch);
+	}
+}
+
+static void messaging_send_subscribe_batch(struct mqtt_subscribe_batch_t *batch)
+{
+	if (batch->count == 0) {
+		return;
+	}
+
+	MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+	opts.onSuccess = messaging_on_subscribe_success;
+	opts.onFailure = messaging_on_subscribe_failure;
+	opts.context = client;
+
+	__atomic_add_fetch(&resubscribe.pending, 1, __ATOMIC_ACQ_REL);
+
+	// The client makes its own copy of the filters.
+	if (MQTTAsync_subscribeMany(client, batch->count, batch->filters, batch->qos, &opts) == MQTTASYNC_SUCCESS) {
+		resubscribe.filters += (uint32_t)batch->count;
+	}
+	else {
+		__atomic_add_fetch(&resubscribe.failed, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&resubscribe.pending, 1, __ATOMIC_ACQ_REL);
+	}
+
+	batch->count = 0;
+}
+
+static void messaging_on_subscribe_success(void *context, MQTTAsync_successData *response)
+{
+	// Called on the MQTT client's thread. Let the event loop know once the last batch has been acknowledged.
+	if (__atomic_sub_fetch(&resubscribe.pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		__atomic_fetch_or(&connection_events, CONNECTION_SUBSCRIBED, __ATOMIC_RELEASE);
+		events_signal_wakeup(connection_wakeup);
+	}
+}
+
+static void messaging_on_subscribe_failure(void *context, MQTTAsync_failureData *response)
+{
+	__atomic_add_fetch(&resubscribe.failed, 1, __ATOMIC_RELAXED);
+	messaging_on_subscribe_success(context, NULL);
+}
+
+static void messaging_on_subscribe_complete(void)
+{
+	resubscribe.duration = utils_get_time_ms() - resubscribe.started;
+
+	int failed = __atomic_load_n(&resubscribe.failed, __ATOMIC_RELAXED);
+
+	if (failed != 0) {
+		output_log("Subscribed to %u topics in %u ms, %d batches failed.", resubscribe.filters, (uint32_t)resubscribe.duration, failed);
+	}
+	else {
+		output_log("Subscribed to %u topics in %u ms.", resubscribe.filters, (uint32_t)resubscribe.duration);
+	}
+}
+
+static void messaging_destroy_node(struct topic_node_t *node, void *context)
+{
+	struct message_topic_t *topic = topic_node_get_data(node);
+
+	LIST_FOREACH_SAFE(struct mqtt_subscription_t, sub, tmp, topic->subscriptions) {
+		tmp = sub->next;
+		utils_free(sub);
+	}
+
+	if (topic->pending_payload != NULL) {
+		scheduler_cancel_timer(topic->flush_timer);
+		messaging_free_payload(topic->pending_payload);
+	}
+
+	if (topic->cached.payload != NULL) {
+		utils_free((char *)topic->cached.payload);
+	}
+
+	MQTTAsync_unregisterTopic(topic->name);
+	utils_free(topic->name);
+	utils_free(topic);
+
+	topic_node_set_data(node, NULL);
+}
+
+static void messaging_on_message_delivered(void *context, MQTTAsync_token token)
+{
+}
+
+#define ADVANCE_BUFFER(buffer, bufvar, written)\
+	bufvar = buffer + written;\
+	if (written >= sizeof(buffer))\
+		return true;
+
+WEB_API_HANDLER(messaging_process_api_request)
+{
+	char interface[128], command[128];
+
+	// Get the command token from the request URL.
+	utils_tokenize_string(request_url, '/', interface, sizeof(interface));
+	utils_tokenize_string(NULL, '/', command, sizeof(command));
+
+	// Get the status of the MQTT client and the delivery queue.
+	if (strcmp(command, "status") == 0) {
+
+		static char buffer[2000];
+
+		char *s = buffer;
+		size_t written = 0;
+		const size_t size = sizeof(buffer);
+
+		*content = buffer;
+
+		uint64_t delivered = delivery_stats.delivered;
+		uint64_t latency_avg = (delivered != 0 ? delivery_stats.latency_total / delivered : 0);
+
+		written += snprintf(s, size - written, "{\n\"result\": true,\n"); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"connected\": %s,\n", is_connected ? "true" : "false"); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"queue_depth\": %u,\n", (unsigned int)queue_count(delivery_queue)); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"queue_capacity\": %u,\n", (unsigned int)queue_capacity(delivery_queue)); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"queue_deferred\": %llu,\n", (unsigned long long)__atomic_load_n(&delivery_stats.deferred, __ATOMIC_RELAXED)); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"delivered\": %llu,\n", (unsigned long long)delivered); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"drain_latency_avg\": %llu,\n", (unsigned long long)latency_avg); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"drain_latency_max\": %llu,\n", (unsigned long long)delivery_stats.latency_max); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"published\": %llu,\n", (unsigned long long)publish_stats.published); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"coalesced\": %llu,\n", (unsigned long long)publish_stats.coalesced); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"subscribed_filters\": %u,\n", resubscribe.filters); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"time_to_subscribed\": %llu,\n", (unsigned long long)resubscribe.duration); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"connect_attempts\": %u,\n", reconnect_attempts); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"offline_pending\": %u,\n", (unsigned int)ring_count(offline_messages)); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"offline_buffered\": %llu,\n", (unsigned long long)offline_stats.buffered); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"offline_dropped\": %llu,\n", (unsigned long long)offline_stats.dropped); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"offline_replayed\": %llu,\n", (unsigned long long)offline_stats.replayed); ADVANCE_BUFFER(buffer, s, written);
+
+		// Allocation statistics of the MQTT client's packet, command and list element pools.
+		MQTTAsync_poolInfo pools[8];
+		int pool_count = MQTTAsync_getPoolInfo(pools, sizeof(pools) / sizeof(pools[0]));
+
+		written += snprintf(s, size - written, "\"pools\": ["); ADVANCE_BUFFER(buffer, s, written);
+
+		for (int i = 0; i < pool_count; ++i) {
+			written += snprintf(s, size - written, "%s\n{ \"name\": \"%s\", \"in_use\": %d, \"cached\": %d, \"objects\": %d, \"allocs\": %lu }",
+				i > 0 ? "," : "", pools[i].name, pools[i].in_use, pools[i].cached, pools[i].objects, pools[i].allocs); ADVANCE_BUFFER(buffer, s, written);
+		}
+
+		written += snprintf(s, size - written, "\n]\n"); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "}\n"); ADVANCE_BUFFER(buffer, s, written);
+
+		return true;
+	}
+
+	// Get the last value received to a topic. The rest of the URL is the topic, i.e. /mqtt/cache/home/lights/l1/toggle
+	else if (strcmp(command, "cache") == 0) {
+
+		char name[256];
+		utils_tokenize_string(NULL, '?', name, sizeof(name));
+
+		struct message_topic_t *topic = messaging_get_topic(name[0] == '/' ? name + 1 : name, false);
+		const struct message_cached_t *cached = messaging_get_cached(topic);
+
+		if (cached == NULL) {
+			return false;
+		}
+
+		static char buffer[4000];
+
+		char *s = buffer;
+		size_t written = 0;
+		const size_t size = sizeof(buffer);
+
+		*content = buffer;
+
+		uint64_t now = utils_get_time_ms();
+
+		written += snprintf(s, size - written, "{\n\"result\": true,\n"); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"topic\": \"%s\",\n", topic->name); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"payload\": \""); ADVANCE_BUFFER(buffer, s, written);
+
+		// Escape the payload for JSON. Payloads are not guaranteed to be text, so stop at the first null.
+		for (size_t i = 0; i < cached->length && cached->payload[i] != 0; ++i) {
+
+			uint8_t c = (uint8_t)cached->payload[i];
+
+			if (c == '"' || c == '\\') {
+				written += snprintf(s, size - written, "\\%c", c);
+			}
+			else if (c < 0x20) {
+				written += snprintf(s, size - written, "\\u%04x", c);
+			}
+			else {
+				written += snprintf(s, size - written, "%c", c);
+			}
+
+			ADVANCE_BUFFER(buffer, s, written);
+		}
+
+		written += snprintf(s, size - written, "\",\n"); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"length\": %u,\n", (unsigned int)cached->length); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"age\": %llu,\n", (unsigned long long)(now > cached->timestamp ? now - cached->timestamp : 0)); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "\"sequence\": %llu\n", (unsigned long long)cached->sequence); ADVANCE_BUFFER(buffer, s, written);
+		written += snprintf(s, size - written, "}\n"); ADVANCE_BUFFER(buffer, s, written);
+
+		return true;
+	}
+
+	// Request was not recognised.
+	return false;
+}
+
+CONFIG_HANDLER(set_mqtt_server)
+{
+	if (*args == 0) {
+		output_log("Usage: mqtt_server <ip address>");
+		return;
+	}
+
+	snprintf(mqtt_server, sizeof(mqtt_server), "%s", args);
+}
+
+CONFIG_HANDLER(set_mqtt_port)
+{
+	if (*args == 0) {
+		output_log("Usage: mqtt_port <port>");
+		return;
+	}
+
+	mqtt_port = (uint16_t)atoi(args);
+}
+
+CONFIG_HANDLER(set_mqtt_coalesce_window)
+{
+	if (*args == 0) {
+		output_log("Usage: mqtt_coalesce_window <milliseconds>");
+		return;
+	}
+
+	mqtt_coalesce_window = (uint32_t)atoi(args);
+}
+
+CONFIG_HANDLER(set_mqtt_offline_buffer_size)
+{
+	if (*args == 0) {
+		output_log("Usage: mqtt_offline_buffer_size <bytes>");
+		return;
+	}
+
+	mqtt_offline_buffer_size = (uint32_t)atoi(args);
+}
+
+CONFIG_HANDLER(set_mqtt_cache_size)
+{
+	if (*args == 0) {
+		output_log("Usage: mqtt_cache_size <topics>");
+		return;
+	}
+
+	mqtt_cache_size = (uint32_t)atoi(args);
+}
+
+CONFIG_HANDLER(set_mqtt_offline_drop_policy)
+{
+	if (strcmp(args, "oldest") == 0) {
+		mqtt_offline_drop_policy = OFFLINE_DROP_OLDEST;
+	}
+	else if (strcmp(args, "newest") == 0) {
+		mqtt_offline_drop_policy = OFFLINE_DROP_NEWEST;
+	}
+	else {
+		output_log("Usage: mqtt_offline_drop_policy <oldest|newest>");
+	}
 }
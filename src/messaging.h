@@ -12,4 +12,20 @@ void messaging_publish_data(void *data, size_t data_size, const char *topic_fmt,
 void messaging_subscribe(void *context, message_update_t callback, const char *topic_fmt, ...);
 void messaging_unsubscribe(void *context, message_update_t callback, const char *topic_fmt, ...);
 
+struct message_topic_t *messaging_intern_topic(const char *topic_fmt, ...);
+void messaging_release_topic(struct message_topic_t *topic);
+void messaging_publish_topic(struct message_topic_t *topic, const char *message);
+void messaging_publish_topic_data(struct message_topic_t *topic, void *data, size_t data_size);
+void messaging_publish_topic_coalesced(struct message_topic_t *topic, const char *message);
+void messaging_subscribe_topic(void *context, message_update_t callback, struct message_topic_t *topic);
+void messaging_unsubscribe_topic(void *context, message_update_t callback, struct message_topic_t *topic);
+void messaging_subscribe_ex(void *context, message_update_ex_t callback, struct message_topic_t *topic);
+void messaging_unsubscribe_ex(void *context, message_update_ex_t callback, struct message_topic_t *topic);
+const char *messaging_get_topic_name(struct message_topic_t *topic);
+void *messaging_alloc_payload(size_t size);
+void messaging_free_payload(void *payload);
+void messaging_publish_payload(void *payload, size_t payload_size, const char *topic_fmt, ...);
+void messaging_publish_topic_payload(struct message_topic_t *topic, void *payload, size_t payload_size);
+const struct message_cached_t *messaging_get_cached(struct message_topic_t *topic);
+
 #endif
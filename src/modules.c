@@ -4,6 +4,8 @@
 #include "utils.h"
 #include "logger.h"
 #include "config.h"
+#include "events.h"
+#include "scheduler.h"
 #include "messaging.h"
 #include "webapi.h"
 #include <stdio.h>
@@ -20,6 +22,12 @@ struct module_t {
 
 static struct module_import_t api;
 static struct module_t *modules;
+static int process_timer = -1;
+
+// Modules which still export a process method are polled at this interval, which matches how often
+// the old main loop called them. The timer is only armed while such a module is loaded, other modules
+// schedule their own timers.
+#define MODULE_PROCESS_INTERVAL 10
 
 #ifdef _WIN32
 #define MODULE_EXTENSION ".dll"
@@ -33,9 +41,11 @@ static void modules_load(const char *name);
 static void modules_unload(struct module_t *module);
 static struct module_t *modules_find(const char *name);
 static void *modules_get_api_pointer(const char *name);
+static void modules_update_process_timer(void);
 
 CONFIG_HANDLER(load_module);
 CONFIG_HANDLER(unload_module);
+EVENT_HANDLER(process_modules);
 
 // --------------------------------------------------------------------------------
 
@@ -51,9 +61,26 @@ void modules_initialize(void)
 	api.message_publish_data = messaging_publish_data;
 	api.message_subscribe = messaging_subscribe;
 	api.message_unsubscribe = messaging_unsubscribe;
+	api.message_intern_topic = messaging_intern_topic;
+	api.message_release_topic = messaging_release_topic;
+	api.message_publish_topic = messaging_publish_topic;
+	api.message_publish_topic_data = messaging_publish_topic_data;
+	api.message_publish_topic_coalesced = messaging_publish_topic_coalesced;
+	api.message_subscribe_topic = messaging_subscribe_topic;
+	api.message_unsubscribe_topic = messaging_unsubscribe_topic;
+	api.message_subscribe_ex = messaging_subscribe_ex;
+	api.message_unsubscribe_ex = messaging_unsubscribe_ex;
+	api.message_get_topic_name = messaging_get_topic_name;
+	api.message_alloc_payload = messaging_alloc_payload;
+	api.message_free_payload = messaging_free_payload;
+	api.message_publish_payload = messaging_publish_payload;
+	api.message_publish_topic_payload = messaging_publish_topic_payload;
+	api.message_get_cached = messaging_get_cached;
 	api.webapi_register_interface = webapi_register_interface;
 	api.webapi_unregister_interface = webapi_unregister_interface;
 	api.get_module_api = modules_get_api_pointer;
+	api.timer_schedule = scheduler_add_timer;
+	api.timer_cancel = scheduler_cancel_timer;
 	api.alloc = utils_alloc;
 	api.free = utils_free;
 	api.duplicate_string = utils_duplicate_string;
@@ -62,10 +89,18 @@ void modules_initialize(void)
 	// Register config handlers for module loading and unloading.
 	config_add_command_handler("load_module", load_module);
 	config_add_command_handler("unload_module", unload_module);
+
+	process_timer = events_create_timer(0, 0, process_modules, NULL);
+	events_clear_timer(process_timer);
 }
 
 void modules_shutdown(void)
 {
+	if (process_timer >= 0) {
+		events_remove_fd(process_timer);
+		process_timer = -1;
+	}
+
 	LIST_FOREACH_SAFE(struct module_t, mod, tmp, modules) {
 		tmp = mod->next;
 		modules_unload(mod);
@@ -142,6 +177,7 @@ static void modules_load(const char *name)
 
 	// Add the module to the loaded module list.
 	LIST_ADD_ENTRY(modules, module);
+	modules_update_process_timer();
 
 	output_log("Loaded module '%s'", module->name);
 }
@@ -150,6 +186,7 @@ static void modules_unload(struct module_t *module)
 {
 	// Remove the module from the loaded mod list.
 	LIST_REMOVE_ENTRY(struct module_t, module, modules);
+	modules_update_process_timer();
 
 	// Inform all the other loaded modules about the unloaded module.
 	LIST_FOREACH(struct module_t, mod, modules) {
@@ -172,6 +209,23 @@ static void modules_unload(struct module_t *module)
 	utils_free(module);
 }
 
+static void modules_update_process_timer(void)
+{
+	if (process_timer < 0) {
+		return;
+	}
+
+	LIST_FOREACH(struct module_t, mod, modules) {
+		if (mod->exports.process != NULL) {
+			events_set_timer(process_timer, MODULE_PROCESS_INTERVAL, MODULE_PROCESS_INTERVAL);
+			return;
+		}
+	}
+
+	// None of the loaded modules need polling.
+	events_clear_timer(process_timer);
+}
+
 static struct module_t *modules_find(const char *name)
 {
 	LIST_FOREACH(struct module_t, mod, modules) {
@@ -197,6 +251,11 @@ static void *modules_get_api_pointer(const char *name)
 	return module->exports.api;
 }
 
+EVENT_HANDLER(process_modules)
+{
+	modules_process();
+}
+
 CONFIG_HANDLER(load_module)
 {
 	if (*args == 0) {
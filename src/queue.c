@@ -0,0 +1,133 @@
+#include "queue.h"
+#include "utils.h"
+#include <string.h>
+
+// --------------------------------------------------------------------------------
+
+// Every slot carries a sequence number which tells whose turn it is to use the slot.
+// For the slot at position p, sequence == p means it is free for the producer which claims position p,
+// and sequence == p + 1 means it has been filled and can be read by the consumer.
+struct queue_slot_t {
+	size_t sequence;
+	uint8_t data[];
+};
+
+#define CACHE_LINE_SIZE 64
+
+struct queue_t {
+	uint8_t *slots;
+	size_t slot_size;
+	size_t item_size;
+	size_t mask;
+
+	// Producers and the consumer advance their own counters, keep them on separate cache lines.
+	uint8_t pad0[CACHE_LINE_SIZE];
+	size_t head; // Next position to be claimed by a producer
+	uint8_t pad1[CACHE_LINE_SIZE];
+	size_t tail; // Next position to be read by the consumer
+	uint8_t pad2[CACHE_LINE_SIZE];
+};
+
+#define QUEUE_SLOT(queue, position) ((struct queue_slot_t *)((queue)->slots + ((position) & (queue)->mask) * (queue)->slot_size))
+
+// --------------------------------------------------------------------------------
+
+struct queue_t *queue_create(size_t capacity, size_t item_size)
+{
+	size_t size = 2;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	struct queue_t *queue = utils_alloc(sizeof(*queue));
+
+	// Round the slot size up so the sequence numbers stay aligned.
+	queue->slot_size = (sizeof(struct queue_slot_t) + item_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+	queue->item_size = item_size;
+	queue->mask = size - 1;
+	queue->slots = utils_alloc(size * queue->slot_size);
+
+	for (size_t i = 0; i < size; ++i) {
+		QUEUE_SLOT(queue, i)->sequence = i;
+	}
+
+	return queue;
+}
+
+void queue_destroy(struct queue_t *queue)
+{
+	if (queue == NULL) {
+		return;
+	}
+
+	utils_free(queue->slots);
+	utils_free(queue);
+}
+
+bool queue_push(struct queue_t *queue, const void *item)
+{
+	struct queue_slot_t *slot;
+	size_t position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+
+		slot = QUEUE_SLOT(queue, position);
+
+		size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+		if (difference == 0) {
+
+			// The slot is free, try to claim the position. On failure the position is reloaded and we try again.
+			if (__atomic_compare_exchange_n(&queue->head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (difference < 0) {
+			// The consumer hasn't read this slot yet, the queue is full.
+			return false;
+		}
+		else {
+			// Another producer got here first.
+			position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(slot->data, item, queue->item_size);
+
+	// Publish the item to the consumer.
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool queue_pop(struct queue_t *queue, void *item)
+{
+	size_t position = queue->tail;
+	struct queue_slot_t *slot = QUEUE_SLOT(queue, position);
+
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+		return false;
+	}
+
+	memcpy(item, slot->data, queue->item_size);
+
+	// Hand the slot back to the producers for the next lap around the ring.
+	__atomic_store_n(&slot->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&queue->tail, position + 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+size_t queue_count(struct queue_t *queue)
+{
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+	return (head > tail ? head - tail : 0);
+}
+
+size_t queue_capacity(struct queue_t *queue)
+{
+	return queue->mask + 1;
+}
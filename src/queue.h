@@ -0,0 +1,25 @@
+#pragma once
+#ifndef __SMARTHOME_QUEUE_H
+#define __SMARTHOME_QUEUE_H
+
+#include "defines.h"
+
+// A bounded, lock-free multi-producer/single-consumer queue of fixed size items.
+// Items are copied into preallocated slots, so pushing never allocates or blocks.
+struct queue_t;
+
+// Capacity is rounded up to the next power of two.
+struct queue_t *queue_create(size_t capacity, size_t item_size);
+void queue_destroy(struct queue_t *queue);
+
+// Can be called from any thread. Returns false if the queue is full.
+bool queue_push(struct queue_t *queue, const void *item);
+
+// Must only be called from the consumer thread. Returns false if the queue is empty.
+bool queue_pop(struct queue_t *queue, void *item);
+
+// Approximate number of items in the queue when called concurrently with producers.
+size_t queue_count(struct queue_t *queue);
+size_t queue_capacity(struct queue_t *queue);
+
+#endif
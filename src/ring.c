@@ -0,0 +1,163 @@
+#include "ring.h"
+#include "utils.h"
+
+// --------------------------------------------------------------------------------
+
+// Every record starts with a header telling the length of the data following it. Records are never split
+// across the end of the buffer: when a record doesn't fit at the end, the writer leaves a wrap marker
+// (or less space than a header, which means the same) and continues from the beginning.
+struct ring_header_t {
+	size_t length;
+};
+
+#define RING_WRAP ((size_t)-1)
+#define RING_ALIGN(x) (((x) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+#define RING_RECORD_SIZE(length) (sizeof(struct ring_header_t) + RING_ALIGN(length))
+
+struct ring_t {
+	uint8_t *buffer;
+	size_t size;
+	size_t head;	// Offset where the next record is written
+	size_t tail;	// Offset of the oldest record
+	size_t count;	// Number of records in the ring
+};
+
+// --------------------------------------------------------------------------------
+
+static void ring_skip_wrap(struct ring_t *ring);
+
+// --------------------------------------------------------------------------------
+
+struct ring_t *ring_create(size_t size)
+{
+	struct ring_t *ring = utils_alloc(sizeof(*ring));
+
+	ring->size = RING_ALIGN(size);
+	ring->buffer = utils_alloc(ring->size);
+
+	return ring;
+}
+
+void ring_destroy(struct ring_t *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	utils_free(ring->buffer);
+	utils_free(ring);
+}
+
+void *ring_push(struct ring_t *ring, size_t size)
+{
+	size_t required = RING_RECORD_SIZE(size);
+	size_t position;
+
+	if (ring->count == 0) {
+		ring->head = 0;
+		ring->tail = 0;
+	}
+
+	if (ring->head > ring->tail || ring->count == 0) {
+
+		// The free space is split in two: from the head to the end of the buffer, and from the beginning to the tail.
+		if (ring->size - ring->head >= required) {
+			position = ring->head;
+		}
+		else if (ring->tail >= required) {
+
+			if (ring->size - ring->head >= sizeof(struct ring_header_t)) {
+				((struct ring_header_t *)(ring->buffer + ring->head))->length = RING_WRAP;
+			}
+
+			position = 0;
+		}
+		else {
+			return NULL;
+		}
+	}
+	else if (ring->head < ring->tail && ring->tail - ring->head >= required) {
+		position = ring->head;
+	}
+	else {
+		// The head has caught up with the tail, the ring is full.
+		return NULL;
+	}
+
+	struct ring_header_t *header = (struct ring_header_t *)(ring->buffer + position);
+	header->length = size;
+
+	ring->head = position + required;
+	++ring->count;
+
+	if (ring->head == ring->size) {
+		ring->head = 0;
+	}
+
+	return header + 1;
+}
+
+void *ring_peek(struct ring_t *ring, size_t *size)
+{
+	if (ring->count == 0) {
+		return NULL;
+	}
+
+	ring_skip_wrap(ring);
+
+	struct ring_header_t *header = (struct ring_header_t *)(ring->buffer + ring->tail);
+
+	if (size != NULL) {
+		*size = header->length;
+	}
+
+	return header + 1;
+}
+
+void ring_pop(struct ring_t *ring)
+{
+	if (ring->count == 0) {
+		return;
+	}
+
+	ring_skip_wrap(ring);
+
+	struct ring_header_t *header = (struct ring_header_t *)(ring->buffer + ring->tail);
+	ring->tail += RING_RECORD_SIZE(header->length);
+
+	if (ring->tail == ring->size) {
+		ring->tail = 0;
+	}
+
+	if (--ring->count == 0) {
+		ring->head = 0;
+		ring->tail = 0;
+	}
+}
+
+size_t ring_count(struct ring_t *ring)
+{
+	return (ring != NULL ? ring->count : 0);
+}
+
+size_t ring_size(struct ring_t *ring)
+{
+	return (ring != NULL ? ring->size : 0);
+}
+
+size_t ring_max_record_size(struct ring_t *ring)
+{
+	if (ring == NULL || ring->size < sizeof(struct ring_header_t)) {
+		return 0;
+	}
+
+	return ring->size - sizeof(struct ring_header_t);
+}
+
+static void ring_skip_wrap(struct ring_t *ring)
+{
+	if (ring->size - ring->tail < sizeof(struct ring_header_t) ||
+		((struct ring_header_t *)(ring->buffer + ring->tail))->length == RING_WRAP) {
+		ring->tail = 0;
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#ifndef __SMARTHOME_RING_H
+#define __SMARTHOME_RING_H
+
+#include "defines.h"
+
+// A bounded FIFO of variable sized records stored back to back in a single preallocated buffer.
+// Not thread safe, meant to be used from the event loop only.
+struct ring_t;
+
+struct ring_t *ring_create(size_t size);
+void ring_destroy(struct ring_t *ring);
+
+// Reserve space for a new record at the end of the ring and return a pointer to it,
+// or NULL if the record doesn't fit in the free space.
+void *ring_push(struct ring_t *ring, size_t size);
+
+// Get the oldest record in the ring, or NULL if the ring is empty.
+void *ring_peek(struct ring_t *ring, size_t *size);
+void ring_pop(struct ring_t *ring);
+
+size_t ring_count(struct ring_t *ring);
+size_t ring_size(struct ring_t *ring);
+
+// Size of the largest record which fits in the ring when it is empty.
+size_t ring_max_record_size(struct ring_t *ring);
+
+#endif
@@ -0,0 +1,244 @@
+#include "scheduler.h"
+#include "events.h"
+#include "utils.h"
+#include <string.h>
+
+// --------------------------------------------------------------------------------
+
+struct scheduled_timer_t {
+	uint32_t identifier;
+	uint64_t deadline;		// Monotonic time in milliseconds when the timer is due next
+	uint32_t interval;		// Period of a repeating timer, 0 for one-shot timers
+	size_t index;			// Position in the heap
+	timer_handler_t handler;
+	void *context;
+};
+
+// All the timers are kept in a binary min-heap ordered by their deadline, and a single timerfd
+// is armed for the earliest one. The event loop only wakes up when the first timer is due.
+static struct scheduled_timer_t **heap;
+static size_t heap_size = 0;
+static size_t heap_capacity = 0;
+
+static uint32_t next_identifier = 1;
+static int scheduler_timer = -1;
+
+// --------------------------------------------------------------------------------
+
+static void scheduler_push(struct scheduled_timer_t *timer);
+static void scheduler_remove(struct scheduled_timer_t *timer);
+static void scheduler_sift_up(size_t index);
+static void scheduler_sift_down(size_t index);
+static void scheduler_arm(void);
+
+EVENT_HANDLER(process_timers);
+
+// --------------------------------------------------------------------------------
+
+void scheduler_initialize(void)
+{
+	scheduler_timer = events_create_timer(0, 0, process_timers, NULL);
+	events_clear_timer(scheduler_timer);
+}
+
+void scheduler_shutdown(void)
+{
+	for (size_t i = 0; i < heap_size; ++i) {
+		utils_free(heap[i]);
+	}
+
+	if (heap != NULL) {
+		utils_free(heap);
+	}
+
+	heap = NULL;
+	heap_size = 0;
+	heap_capacity = 0;
+
+	if (scheduler_timer >= 0) {
+		events_remove_fd(scheduler_timer);
+		scheduler_timer = -1;
+	}
+}
+
+uint32_t scheduler_add_timer(uint32_t delay_ms, uint32_t interval_ms, timer_handler_t handler, void *context)
+{
+	if (handler == NULL) {
+		return 0;
+	}
+
+	struct scheduled_timer_t *timer = utils_alloc(sizeof(*timer));
+	timer->identifier = next_identifier++;
+	timer->deadline = utils_get_time_ms() + delay_ms;
+	timer->interval = interval_ms;
+	timer->handler = handler;
+	timer->context = context;
+
+	// Skip 0 when the identifier wraps around, it is used to indicate an invalid timer.
+	if (next_identifier == 0) {
+		next_identifier = 1;
+	}
+
+	scheduler_push(timer);
+	scheduler_arm();
+
+	return timer->identifier;
+}
+
+void scheduler_cancel_timer(uint32_t identifier)
+{
+	if (identifier == 0) {
+		return;
+	}
+
+	// Timers are cancelled rarely and there are only a handful of them, so a linear search is good enough here.
+	for (size_t i = 0; i < heap_size; ++i) {
+
+		struct scheduled_timer_t *timer = heap[i];
+
+		if (timer->identifier == identifier) {
+			scheduler_remove(timer);
+			utils_free(timer);
+
+			scheduler_arm();
+			return;
+		}
+	}
+}
+
+static void scheduler_push(struct scheduled_timer_t *timer)
+{
+	if (heap_size == heap_capacity) {
+
+		size_t capacity = (heap_capacity != 0 ? 2 * heap_capacity : 16);
+		struct scheduled_timer_t **resized = utils_alloc(capacity * sizeof(*resized));
+
+		if (heap != NULL) {
+			memcpy(resized, heap, heap_size * sizeof(*heap));
+			utils_free(heap);
+		}
+
+		heap = resized;
+		heap_capacity = capacity;
+	}
+
+	timer->index = heap_size;
+	heap[heap_size++] = timer;
+
+	scheduler_sift_up(timer->index);
+}
+
+static void scheduler_remove(struct scheduled_timer_t *timer)
+{
+	size_t index = timer->index;
+	struct scheduled_timer_t *last = heap[--heap_size];
+
+	if (last == timer) {
+		return;
+	}
+
+	// Move the last timer into the removed slot and restore the heap order.
+	heap[index] = last;
+	last->index = index;
+
+	scheduler_sift_up(index);
+	scheduler_sift_down(last->index);
+}
+
+static void scheduler_sift_up(size_t index)
+{
+	struct scheduled_timer_t *timer = heap[index];
+
+	while (index > 0) {
+
+		size_t parent = (index - 1) / 2;
+
+		if (heap[parent]->deadline <= timer->deadline) {
+			break;
+		}
+
+		heap[index] = heap[parent];
+		heap[index]->index = index;
+		index = parent;
+	}
+
+	heap[index] = timer;
+	timer->index = index;
+}
+
+static void scheduler_sift_down(size_t index)
+{
+	struct scheduled_timer_t *timer = heap[index];
+
+	for (;;) {
+
+		size_t child = 2 * index + 1;
+
+		if (child >= heap_size) {
+			break;
+		}
+
+		if (child + 1 < heap_size && heap[child + 1]->deadline < heap[child]->deadline) {
+			++child;
+		}
+
+		if (timer->deadline <= heap[child]->deadline) {
+			break;
+		}
+
+		heap[index] = heap[child];
+		heap[index]->index = index;
+		index = child;
+	}
+
+	heap[index] = timer;
+	timer->index = index;
+}
+
+static void scheduler_arm(void)
+{
+	if (heap_size == 0) {
+		events_clear_timer(scheduler_timer);
+		return;
+	}
+
+	uint64_t now = utils_get_time_ms();
+	uint64_t deadline = heap[0]->deadline;
+
+	events_set_timer(scheduler_timer, (uint32_t)(deadline > now ? deadline - now : 0), 0);
+}
+
+EVENT_HANDLER(process_timers)
+{
+	uint64_t now = utils_get_time_ms();
+
+	// Run every timer which is due. The handlers are free to add and cancel timers while this is going on.
+	while (heap_size > 0 && heap[0]->deadline <= now) {
+
+		struct scheduled_timer_t *timer = heap[0];
+		timer_handler_t handler = timer->handler;
+		void *context = timer->context;
+
+		scheduler_remove(timer);
+
+		if (timer->interval != 0) {
+
+			// Reschedule repeating timers. If the process has stalled for longer than the interval,
+			// skip the missed periods instead of firing a burst of callbacks.
+			timer->deadline += timer->interval;
+
+			if (timer->deadline <= now) {
+				timer->deadline = now + timer->interval;
+			}
+
+			scheduler_push(timer);
+		}
+		else {
+			utils_free(timer);
+		}
+
+		handler(context);
+	}
+
+	scheduler_arm();
+}
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef __SMARTHOME_SCHEDULER_H
+#define __SMARTHOME_SCHEDULER_H
+
+#include "defines.h"
+#include "module.h"
+
+void scheduler_initialize(void);
+void scheduler_shutdown(void);
+
+// Run the handler once after delay_ms, and then every interval_ms if the interval is not 0.
+// Returns an identifier for the timer which can be used to cancel it, or 0 on failure.
+uint32_t scheduler_add_timer(uint32_t delay_ms, uint32_t interval_ms, timer_handler_t handler, void *context);
+void scheduler_cancel_timer(uint32_t timer);
+
+#endif
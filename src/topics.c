@@ -0,0 +1,338 @@
+#include "topics.h"
+#include "utils.h"
+#include <string.h>
+
+// --------------------------------------------------------------------------------
+
+struct topic_node_t {
+	struct topic_node_t *parent;
+	struct topic_node_t *next;				// Next node in the same hash bucket of the parent
+	struct topic_node_t **buckets;			// Child nodes for regular topic levels, hashed by level name
+	size_t bucket_count;
+	size_t child_count;
+	struct topic_node_t *single_wildcard;	// Child node for the '+' level
+	struct topic_node_t *multi_wildcard;	// Child node for the '#' level
+	void *data;
+	uint32_t hash;
+	size_t length;
+	char level[];
+};
+
+struct topic_tree_t {
+	struct topic_node_t *root;
+};
+
+#define TOPIC_INITIAL_BUCKETS 4
+
+// --------------------------------------------------------------------------------
+
+static uint32_t topic_hash_level(const char *level, size_t length);
+static struct topic_node_t *topic_create_node(struct topic_node_t *parent, const char *level, size_t length, uint32_t hash);
+static void topic_destroy_node(struct topic_node_t *node);
+static struct topic_node_t *topic_get_child(struct topic_node_t *node, const char *level, size_t length, uint32_t hash);
+static void topic_add_child(struct topic_node_t *node, struct topic_node_t *child);
+static void topic_remove_child(struct topic_node_t *node, struct topic_node_t *child);
+static void topic_match_level(struct topic_node_t *node, const char *topic, bool is_first, topic_match_t handler, void *context);
+static void topic_foreach_node(struct topic_node_t *node, topic_match_t handler, void *context);
+
+// --------------------------------------------------------------------------------
+
+struct topic_tree_t *topic_tree_create(void)
+{
+	struct topic_tree_t *tree = utils_alloc(sizeof(*tree));
+	tree->root = topic_create_node(NULL, "", 0, 0);
+
+	return tree;
+}
+
+void topic_tree_destroy(struct topic_tree_t *tree)
+{
+	if (tree == NULL) {
+		return;
+	}
+
+	topic_destroy_node(tree->root);
+	utils_free(tree);
+}
+
+struct topic_node_t *topic_tree_find(struct topic_tree_t *tree, const char *filter, bool create)
+{
+	struct topic_node_t *node = tree->root;
+	const char *level = filter;
+
+	for (;;) {
+
+		const char *end = strchr(level, '/');
+		size_t length = (end != NULL ? (size_t)(end - level) : strlen(level));
+		uint32_t hash = topic_hash_level(level, length);
+
+		struct topic_node_t *child = topic_get_child(node, level, length, hash);
+
+		if (child == NULL) {
+
+			if (!create) {
+				return NULL;
+			}
+
+			child = topic_create_node(node, level, length, hash);
+			topic_add_child(node, child);
+		}
+
+		node = child;
+
+		if (end == NULL) {
+			return node;
+		}
+
+		level = end + 1;
+	}
+}
+
+void topic_tree_prune(struct topic_tree_t *tree, struct topic_node_t *node)
+{
+	// Walk up towards the root and remove every level which is no longer used by any filter.
+	while (node != NULL && node != tree->root &&
+		   node->data == NULL &&
+		   node->child_count == 0 &&
+		   node->single_wildcard == NULL &&
+		   node->multi_wildcard == NULL) {
+
+		struct topic_node_t *parent = node->parent;
+
+		topic_remove_child(parent, node);
+		topic_destroy_node(node);
+
+		node = parent;
+	}
+}
+
+void topic_tree_match(struct topic_tree_t *tree, const char *topic, topic_match_t handler, void *context)
+{
+	if (topic == NULL || handler == NULL) {
+		return;
+	}
+
+	topic_match_level(tree->root, topic, true, handler, context);
+}
+
+void topic_tree_foreach(struct topic_tree_t *tree, topic_match_t handler, void *context)
+{
+	if (handler == NULL) {
+		return;
+	}
+
+	topic_foreach_node(tree->root, handler, context);
+}
+
+void *topic_node_get_data(struct topic_node_t *node)
+{
+	return node->data;
+}
+
+void topic_node_set_data(struct topic_node_t *node, void *data)
+{
+	node->data = data;
+}
+
+static uint32_t topic_hash_level(const char *level, size_t length)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (uint8_t)level[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct topic_node_t *topic_create_node(struct topic_node_t *parent, const char *level, size_t length, uint32_t hash)
+{
+	struct topic_node_t *node = utils_alloc(sizeof(*node) + length + 1);
+
+	node->parent = parent;
+	node->hash = hash;
+	node->length = length;
+
+	memcpy(node->level, level, length);
+	node->level[length] = 0;
+
+	return node;
+}
+
+static void topic_destroy_node(struct topic_node_t *node)
+{
+	if (node == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < node->bucket_count; ++i) {
+
+		for (struct topic_node_t *child = node->buckets[i], *tmp = NULL; child != NULL; child = tmp) {
+			tmp = child->next;
+			topic_destroy_node(child);
+		}
+	}
+
+	topic_destroy_node(node->single_wildcard);
+	topic_destroy_node(node->multi_wildcard);
+
+	if (node->buckets != NULL) {
+		utils_free(node->buckets);
+	}
+
+	utils_free(node);
+}
+
+static struct topic_node_t *topic_get_child(struct topic_node_t *node, const char *level, size_t length, uint32_t hash)
+{
+	if (length == 1 && *level == '+') {
+		return node->single_wildcard;
+	}
+	if (length == 1 && *level == '#') {
+		return node->multi_wildcard;
+	}
+
+	if (node->bucket_count == 0) {
+		return NULL;
+	}
+
+	for (struct topic_node_t *child = node->buckets[hash & (node->bucket_count - 1)]; child != NULL; child = child->next) {
+
+		if (child->hash == hash &&
+			child->length == length &&
+			memcmp(child->level, level, length) == 0) {
+			return child;
+		}
+	}
+
+	return NULL;
+}
+
+static void topic_add_child(struct topic_node_t *node, struct topic_node_t *child)
+{
+	if (child->length == 1 && *child->level == '+') {
+		node->single_wildcard = child;
+		return;
+	}
+	if (child->length == 1 && *child->level == '#') {
+		node->multi_wildcard = child;
+		return;
+	}
+
+	// Keep the load factor at or below one by doubling the bucket array when it fills up.
+	if (node->child_count >= node->bucket_count) {
+
+		size_t bucket_count = (node->bucket_count != 0 ? 2 * node->bucket_count : TOPIC_INITIAL_BUCKETS);
+		struct topic_node_t **buckets = utils_alloc(bucket_count * sizeof(*buckets));
+
+		for (size_t i = 0; i < node->bucket_count; ++i) {
+
+			for (struct topic_node_t *entry = node->buckets[i], *tmp = NULL; entry != NULL; entry = tmp) {
+
+				tmp = entry->next;
+
+				size_t index = entry->hash & (bucket_count - 1);
+				entry->next = buckets[index];
+				buckets[index] = entry;
+			}
+		}
+
+		if (node->buckets != NULL) {
+			utils_free(node->buckets);
+		}
+
+		node->buckets = buckets;
+		node->bucket_count = bucket_count;
+	}
+
+	size_t index = child->hash & (node->bucket_count - 1);
+
+	child->next = node->buckets[index];
+	node->buckets[index] = child;
+
+	++node->child_count;
+}
+
+static void topic_remove_child(struct topic_node_t *node, struct topic_node_t *child)
+{
+	if (child == node->single_wildcard) {
+		node->single_wildcard = NULL;
+		return;
+	}
+	if (child == node->multi_wildcard) {
+		node->multi_wildcard = NULL;
+		return;
+	}
+
+	struct topic_node_t **bucket = &node->buckets[child->hash & (node->bucket_count - 1)];
+
+	for (; *bucket != NULL; bucket = &(*bucket)->next) {
+
+		if (*bucket == child) {
+			*bucket = child->next;
+			--node->child_count;
+			return;
+		}
+	}
+}
+
+static void topic_match_level(struct topic_node_t *node, const char *topic, bool is_first, topic_match_t handler, void *context)
+{
+	// Topics starting with '$' are reserved for the server and are not matched by wildcards on the first level.
+	bool allow_wildcards = !(is_first && topic != NULL && *topic == '$');
+
+	// A '#' level matches the rest of the topic, including the parent level itself ("home/#" matches "home").
+	if (allow_wildcards && node->multi_wildcard != NULL && node->multi_wildcard->data != NULL) {
+		handler(node->multi_wildcard, context);
+	}
+
+	// The whole topic has been consumed, this node is an exact match.
+	if (topic == NULL) {
+
+		if (node->data != NULL) {
+			handler(node, context);
+		}
+		return;
+	}
+
+	const char *end = strchr(topic, '/');
+	size_t length = (end != NULL ? (size_t)(end - topic) : strlen(topic));
+	const char *next = (end != NULL ? end + 1 : NULL);
+
+	if (node->bucket_count != 0) {
+
+		struct topic_node_t *child = topic_get_child(node, topic, length, topic_hash_level(topic, length));
+
+		// Published topics can't contain wildcards, so a literal '+' or '#' level in the topic is never a match.
+		if (child != NULL && child != node->single_wildcard && child != node->multi_wildcard) {
+			topic_match_level(child, next, false, handler, context);
+		}
+	}
+
+	if (allow_wildcards && node->single_wildcard != NULL) {
+		topic_match_level(node->single_wildcard, next, false, handler, context);
+	}
+}
+
+static void topic_foreach_node(struct topic_node_t *node, topic_match_t handler, void *context)
+{
+	if (node == NULL) {
+		return;
+	}
+
+	if (node->data != NULL) {
+		handler(node, context);
+	}
+
+	for (size_t i = 0; i < node->bucket_count; ++i) {
+
+		for (struct topic_node_t *child = node->buckets[i]; child != NULL; child = child->next) {
+			topic_foreach_node(child, handler, context);
+		}
+	}
+
+	topic_foreach_node(node->single_wildcard, handler, context);
+	topic_foreach_node(node->multi_wildcard, handler, context);
+}
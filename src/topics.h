@@ -0,0 +1,34 @@
+#pragma once
+#ifndef __SMARTHOME_TOPICS_H
+#define __SMARTHOME_TOPICS_H
+
+#include "defines.h"
+
+// A tree of MQTT topic filters indexed by topic level. Every node stores one level of a filter
+// ("home", "lights", "+", "#"), and matching a published topic against all the filters in the tree
+// only visits the nodes along the topic's levels and the wildcard branches next to them.
+struct topic_tree_t;
+struct topic_node_t;
+
+typedef void (*topic_match_t)(struct topic_node_t *node, void *context);
+
+struct topic_tree_t *topic_tree_create(void);
+void topic_tree_destroy(struct topic_tree_t *tree);
+
+// Find the node for a topic filter, creating the missing levels when create is set.
+struct topic_node_t *topic_tree_find(struct topic_tree_t *tree, const char *filter, bool create);
+
+// Remove the node and its unused parents once it has no data and no children left.
+void topic_tree_prune(struct topic_tree_t *tree, struct topic_node_t *node);
+
+// Call the handler for every node with data whose filter matches the published topic.
+void topic_tree_match(struct topic_tree_t *tree, const char *topic, topic_match_t handler, void *context);
+
+// Call the handler for every node with data in the tree.
+void topic_tree_foreach(struct topic_tree_t *tree, topic_match_t handler, void *context);
+
+// User data attached to a node. A node with data is never pruned.
+void *topic_node_get_data(struct topic_node_t *node);
+void topic_node_set_data(struct topic_node_t *node, void *data);
+
+#endif
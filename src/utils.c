@@ -70,6 +70,11 @@ char *utils_tokenize_string(const char *text, char delimiter, char *dst, size_t
 #include <Windows.h>
 #include <process.h>
 
+uint64_t utils_get_time_ms(void)
+{
+	return (uint64_t)GetTickCount64();
+}
+
 void utils_thread_create(thread_t func, void *args)
 {
 	uint32_t thread_addr;
@@ -119,6 +124,14 @@ void *utils_load_library_symbol(void *handle, const char *name)
 #include <dlfcn.h>
 #include <time.h>
 
+uint64_t utils_get_time_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (uint64_t)t.tv_sec * 1000 + (uint64_t)(t.tv_nsec / 1000000L);
+}
+
 void utils_thread_create(thread_t func, void *args)
 {
 	pthread_t thread;
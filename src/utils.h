@@ -18,6 +18,8 @@ void utils_free(void *ptr);
 char *utils_duplicate_string(const char *text);
 char *utils_tokenize_string(const char *text, char delimiter, char *dst, size_t dst_len);
 
+uint64_t utils_get_time_ms(void);
+
 void utils_thread_create(thread_t method, void *args);
 void utils_thread_sleep(uint32_t ms);
 
@@ -1,16 +1,27 @@
 #include "webapi.h"
 #include "config.h"
+#include "events.h"
 #include "utils.h"
 #include "logger.h"
 #include "httpserver.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 static uint16_t webapi_port = 8080;
 static char *webapi_static_directory;
 
-static bool listening = false;
+static volatile bool listening = false;
+static volatile bool thread_running = false;
+
+static int start_timer = -1;		// Starts the HTTP server once the config has been loaded, and retries on failure
+static int request_wakeup = -1;		// Wakes up the event loop when the HTTP thread has a request pending
+static int response_event = -1;		// The HTTP thread blocks on this until the event loop has handled the request
+
+static struct http_request_t *volatile pending_request;
+static struct http_response_t pending_response;
 
 struct web_api_interface_t {
 	char *name;
@@ -29,10 +40,19 @@ struct web_api_interface_t *interfaces = NULL;
 "	\"result\": %s\n"\
 "}\n"
 
+#define WEBAPI_LISTEN_TIMEOUT 1000 // How long the HTTP thread blocks waiting for connections before checking for shutdown
+#define WEBAPI_RETRY_INTERVAL 5000
+
 // --------------------------------------------------------------------------------
 
 static struct web_api_interface_t *webapi_get_interface(const char *name);
 static struct http_response_t webapi_handle_request(struct http_request_t *request);
+static struct http_response_t webapi_process_request(struct http_request_t *request);
+static void webapi_serve_pending_request(void);
+
+EVENT_HANDLER(start_server);
+EVENT_HANDLER(process_pending_request);
+THREAD(webapi_thread);
 
 CONFIG_HANDLER(set_webapi_port);
 CONFIG_HANDLER(set_webapi_static_directory);
@@ -46,14 +66,43 @@ void webapi_initialize(void)
 
 	// Set the location of the static HTML files.
 	config_add_command_handler("webapi_static_directory", set_webapi_static_directory);
+
+	// Requests are received on a separate thread but handled on the event loop, where the modules live.
+	request_wakeup = events_create_wakeup(process_pending_request, NULL);
+	response_event = eventfd(0, EFD_CLOEXEC);
+
+	// Start the server on the first pass of the event loop to give the config a chance to load.
+	start_timer = events_create_timer(0, 0, start_server, NULL);
 }
 
 void webapi_shutdown(void)
 {
-	// Shut down the HTTP server.
+	// Stop the HTTP thread and shut down the server. Requests which are still coming in are refused.
 	if (listening) {
-		http_server_shutdown();
+
 		listening = false;
+
+		while (thread_running) {
+			webapi_serve_pending_request();
+			utils_thread_sleep(10);
+		}
+
+		http_server_shutdown();
+	}
+
+	if (start_timer >= 0) {
+		events_remove_fd(start_timer);
+		start_timer = -1;
+	}
+
+	if (request_wakeup >= 0) {
+		events_remove_fd(request_wakeup);
+		request_wakeup = -1;
+	}
+
+	if (response_event >= 0) {
+		close(response_event);
+		response_event = -1;
 	}
 
 	if (webapi_static_directory != NULL) {
@@ -63,47 +112,12 @@ void webapi_shutdown(void)
 
 	// Destroy all interfaces.
 	LIST_FOREACH_SAFE(struct web_api_interface_t, iface, tmp, interfaces) {
+		tmp = iface->next;
 		utils_free(iface->name);
 		utils_free(iface);
 	}
-}
-
-void webapi_process(void)
-{
-	if (!listening) {
-		// If the HTTP server is not listening yet, initialize it.
-		// We do the initialization in the processing loop to give the config a chance to load.
-		struct server_settings_t settings;
-		memset(&settings, 0, sizeof(settings));
-
-		struct server_directory_t directories[] = { { "/", webapi_static_directory } };
-
-		settings.handler = webapi_handle_request;
-		settings.port = webapi_port;
-		settings.timeout = 10;
-		settings.max_connections = 25;
-		settings.connection_timeout = 60;
-		settings.directories = directories;
-		settings.directories_len = 0;
-
-		// Serve static files from a dedicated folder.
-		if (webapi_static_directory != NULL) {
-			settings.directories_len = 1;
-		}
 
-		if (http_server_initialize(settings)) {
-
-			listening = true;
-			output_log("Started web API server on port %u", webapi_port);
-		}
-		else {
-			output_error("Failed to start the web API server on port %u, retrying in 5 seconds...", webapi_port);
-			utils_thread_sleep(5000);
-		}
-	}
-	else {
-		http_server_listen();
-	}
+	interfaces = NULL;
 }
 
 void webapi_register_interface(const char *iface, web_api_handler_t handler)
@@ -146,6 +160,89 @@ static struct web_api_interface_t *webapi_get_interface(const char *name)
 }
 
 static struct http_response_t webapi_handle_request(struct http_request_t *request)
+{
+	// Called on the HTTP thread. Hand the request over to the event loop and wait until it has been handled.
+	pending_request = request;
+	events_signal_wakeup(request_wakeup);
+
+	uint64_t value;
+	ssize_t n = read(response_event, &value, sizeof(value));
+	(void)n;
+
+	return pending_response;
+}
+
+static void webapi_serve_pending_request(void)
+{
+	struct http_request_t *request = pending_request;
+
+	if (request == NULL) {
+		return;
+	}
+
+	pending_response = webapi_process_request(request);
+	pending_request = NULL;
+
+	// Let the HTTP thread send the response.
+	uint64_t value = 1;
+	ssize_t n = write(response_event, &value, sizeof(value));
+	(void)n;
+}
+
+EVENT_HANDLER(process_pending_request)
+{
+	webapi_serve_pending_request();
+}
+
+EVENT_HANDLER(start_server)
+{
+	struct server_settings_t settings;
+	memset(&settings, 0, sizeof(settings));
+
+	struct server_directory_t directories[] = { { "/", webapi_static_directory } };
+
+	settings.handler = webapi_handle_request;
+	settings.port = webapi_port;
+	settings.timeout = WEBAPI_LISTEN_TIMEOUT;
+	settings.max_connections = 25;
+	settings.connection_timeout = 60;
+	settings.directories = directories;
+	settings.directories_len = 0;
+
+	// Serve static files from a dedicated folder.
+	if (webapi_static_directory != NULL) {
+		settings.directories_len = 1;
+	}
+
+	if (http_server_initialize(settings)) {
+
+		listening = true;
+		thread_running = true;
+
+		utils_thread_create(webapi_thread, NULL);
+
+		output_log("Started web API server on port %u", webapi_port);
+	}
+	else {
+		output_error("Failed to start the web API server on port %u, retrying in %u seconds...", webapi_port, WEBAPI_RETRY_INTERVAL / 1000);
+		events_set_timer(start_timer, WEBAPI_RETRY_INTERVAL, 0);
+	}
+}
+
+THREAD(webapi_thread)
+{
+	(void)args;
+
+	// The HTTP server blocks while waiting for connections, so it is run on its own thread.
+	while (listening) {
+		http_server_listen();
+	}
+
+	thread_running = false;
+	return 0;
+}
+
+static struct http_response_t webapi_process_request(struct http_request_t *request)
 {
 	struct http_response_t response;
 	response.message = HTTP_400_BAD_REQUEST;
@@ -175,7 +272,7 @@ static struct http_response_t webapi_handle_request(struct http_request_t *reque
 
 	*dst = 0;
 
-	char result[32];
+	static char result[32];
 
 	// Try to find the handler for the requested interface.
 	struct web_api_interface_t *interface = webapi_get_interface(interface_name);
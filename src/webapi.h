@@ -7,7 +7,6 @@
 
 void webapi_initialize(void);
 void webapi_shutdown(void);
-void webapi_process(void);
 void webapi_register_interface(const char *iface, web_api_handler_t handler);
 void webapi_unregister_interface(const char *iface);
 
@@ -0,0 +1,152 @@
+// Tests for the message dispatch and the topic cache. The messaging source is included directly, so the tests can
+// feed messages to it the way the MQTT client would and look at its internal state afterwards. Build and run with
+// make test, which also enables the address sanitizer to catch handlers which free memory still in use.
+
+#include "../src/messaging.c"
+
+// --------------------------------------------------------------------------------
+
+static int tests = 0;
+static int failures = 0;
+
+#define TEST_ASSERT(condition, description)\
+	test_assert(__LINE__, (condition), description)
+
+static void test_assert(int line, bool condition, const char *description)
+{
+	++tests;
+
+	if (!condition) {
+		++failures;
+		printf("FAILED line %d: %s\n", line, description);
+	}
+}
+
+// Normally initialized by the MQTT client when it is created, the test doesn't create one.
+int Heap_initialize(void);
+
+// The daemon's main and web API aren't linked into the test.
+const char *get_config_directory(void)
+{
+	return "./config";
+}
+
+void webapi_register_interface(const char *iface, web_api_handler_t handler)
+{
+}
+
+void webapi_unregister_interface(const char *iface)
+{
+}
+
+// --------------------------------------------------------------------------------
+
+// Hand a message to the messaging system like the MQTT client does, then process it on the event loop.
+static void test_deliver(const char *name, const char *payload)
+{
+	// The message and its payload are allocated after the topic name, and freed with it.
+	size_t name_size = (strlen(name) + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	size_t length = strlen(payload);
+
+	char *topic = MQTTAsync_malloc(name_size + sizeof(MQTTAsync_message) + length);
+	MQTTAsync_message *message = (MQTTAsync_message *)(topic + name_size);
+
+	strcpy(topic, name);
+
+	MQTTAsync_message initializer = MQTTAsync_message_initializer;
+	*message = initializer;
+	message->payload = (char *)(message + 1);
+	message->payloadlen = (int)length;
+	memcpy(message->payload, payload, length);
+
+	messaging_on_message_arrived(NULL, topic, 0, message);
+	process_deliveries(delivery_wakeup, EVENT_READ, NULL);
+}
+
+static int one_shot_calls = 0;
+
+MESSAGE_HANDLER_EX(one_shot)
+{
+	++one_shot_calls;
+	messaging_unsubscribe_ex(context, one_shot, context);
+}
+
+static int releasing_calls = 0;
+
+MESSAGE_HANDLER_EX(releasing)
+{
+	++releasing_calls;
+	messaging_unsubscribe_ex(context, releasing, context);
+	messaging_release_topic(context);
+}
+
+// --------------------------------------------------------------------------------
+
+static void test_one_shot_without_cache(void)
+{
+	// Nothing keeps a topic once its last subscriber is gone.
+	mqtt_cache_size = 0;
+	one_shot_calls = 0;
+
+	struct message_topic_t *topic = messaging_intern_topic("test/one_shot");
+	messaging_subscribe_ex(topic, one_shot, topic);
+	messaging_release_topic(topic);
+
+	test_deliver("test/one_shot", "1");
+
+	TEST_ASSERT(one_shot_calls == 1, "one-shot handler is called once");
+	TEST_ASSERT(messaging_get_topic("test/one_shot", false) == NULL, "topic is freed after its handler unsubscribes");
+
+	test_deliver("test/one_shot", "2");
+
+	TEST_ASSERT(one_shot_calls == 1, "unsubscribed handler is not called again");
+	TEST_ASSERT(messaging_get_topic("test/one_shot", false) == NULL, "uncached topic is not kept");
+}
+
+static void test_one_shot_with_cache(void)
+{
+	// The last value of a topic nobody uses is kept, within the cache size.
+	mqtt_cache_size = 1;
+	releasing_calls = 0;
+
+	struct message_topic_t *topic = messaging_intern_topic("test/releasing");
+	messaging_subscribe_ex(topic, releasing, topic);
+
+	test_deliver("test/releasing", "value");
+
+	TEST_ASSERT(releasing_calls == 1, "releasing handler is called once");
+
+	topic = messaging_get_topic("test/releasing", false);
+
+	TEST_ASSERT(topic != NULL && topic->is_unused, "released topic is kept for its cached value");
+	TEST_ASSERT(topic != NULL && strcmp(topic->cached.payload, "value") == 0, "cached value is the last payload");
+
+	// A newer unused topic evicts the older one.
+	test_deliver("test/other", "other");
+
+	TEST_ASSERT(messaging_get_topic("test/releasing", false) == NULL, "oldest unused topic is evicted");
+	TEST_ASSERT(messaging_get_topic("test/other", false) != NULL, "newest unused topic is kept");
+	TEST_ASSERT(unused_topics.count == 1, "cache holds no more topics than its size");
+}
+
+int main(int argc, char **argv)
+{
+	Heap_initialize();
+
+	events_initialize();
+	scheduler_initialize();
+	config_initialize();
+	messaging_initialize();
+
+	test_one_shot_without_cache();
+	test_one_shot_with_cache();
+
+	messaging_shutdown();
+	config_shutdown();
+	scheduler_shutdown();
+	events_shutdown();
+
+	printf("%d tests run, %d failures.\n", tests, failures);
+
+	return (failures == 0 ? 0 : 1);
+}